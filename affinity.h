@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+//cpus a thread may run on, written as a list "0-3,8,10-11" or as "node:N" for every cpu of a NUMA node
+//threads created by a pinned thread inherit its set, so pinning the parser before it starts its parse
+//threads places them as well; memory is first touched by the thread that allocates it, bulks by the parser,
+//so the parser and the workers that consume its bulks belong on the same node
+class CpuSet
+{
+public:
+    CpuSet() = default;
+
+    //false when spec is malformed or names a node the kernel does not know
+    bool parse(const std::string &spec)
+    {
+        m_cpus.clear();
+        if (spec.compare(0, 5, "node:") == 0)
+        {
+            std::ifstream list("/sys/devices/system/node/node" + spec.substr(5) + "/cpulist");
+            std::string cpus;
+            if (spec.size() == 5 || spec.find_first_not_of("0123456789", 5) != std::string::npos || !std::getline(list, cpus))
+                return false;
+            return parseList(cpus);
+        }
+        return parseList(spec);
+    }
+
+    bool empty() const { return m_cpus.empty(); }
+    std::size_t size() const { return m_cpus.size(); }
+    const std::vector<int> &cpus() const { return m_cpus; }
+
+    //the calling thread may run on any cpu of the set, false when the set is empty or refused
+    bool pin() const
+    {
+        return apply(m_cpus.begin(), m_cpus.end());
+    }
+
+    //the calling thread runs on the index-th cpu only, a pool spreads one thread per cpu this way
+    bool pinOne(std::size_t index) const
+    {
+        if (m_cpus.empty())
+            return false;
+        auto cpu = m_cpus.begin() + index % m_cpus.size();
+        return apply(cpu, cpu + 1);
+    }
+
+private:
+    bool parseList(const std::string &list)
+    {
+        const char *p = list.c_str();
+        while (*p)
+        {
+            char *end;
+            long first = std::strtol(p, &end, 10);
+            long last = first;
+            if (end == p || first < 0)
+                return false;
+            if (*end == '-')
+            {
+                p = end + 1;
+                last = std::strtol(p, &end, 10);
+                if (end == p || last < first)
+                    return false;
+            }
+            if (last >= CPU_SETSIZE)
+                return false;
+            for (long cpu = first; cpu <= last; ++cpu)
+                m_cpus.push_back(static_cast<int>(cpu));
+
+            p = end;
+            if (*p == ',')
+                ++p;
+            else if (*p != '\0' && *p != '\n')
+                return false;
+            else
+                break;
+        }
+        return !m_cpus.empty();
+    }
+
+    template<typename Iterator>
+    static bool apply(Iterator first, Iterator last)
+    {
+        if (first == last)
+            return false;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (; first != last; ++first)
+            CPU_SET(*first, &set);
+        return ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set) == 0;
+    }
+
+    std::vector<int> m_cpus;
+};
+
+//the cpu the calling thread runs on right now, -1 when unknown
+inline int currentCpu()
+{
+    return ::sched_getcpu();
+}
@@ -0,0 +1,64 @@
+//counting operator new, linked into bulkmt_allocs and bulkmt_bench only
+//every allocation of the process goes through here, allocstats.h charges it to the site of its thread
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+#include "allocstats.h"
+
+namespace
+{
+
+struct CountingOn
+{
+    CountingOn() { allocCounting().store(true, std::memory_order_relaxed); }
+} countingOn;
+
+void *allocate(std::size_t size)
+{
+    countAllocation(size);
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+}
+
+//array and nothrow forms of the standard library come through these two
+void *operator new(std::size_t size)
+{
+    return allocate(size);
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+#ifdef __cpp_aligned_new
+//the queue positions are cache line aligned, this form does not fall back to the plain one
+void *operator new(std::size_t size, std::align_val_t alignment)
+{
+    countAllocation(size);
+    std::size_t align = std::max(static_cast<std::size_t>(alignment), sizeof(void *));
+    void *p;
+    if (::posix_memalign(&p, align, size ? size : 1) == 0)
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p, std::align_val_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t, std::align_val_t) noexcept
+{
+    std::free(p);
+}
+#endif
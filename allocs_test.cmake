@@ -0,0 +1,56 @@
+#проверка ctest: bulkmt_allocs на входе INPUT, повторенном REPEAT раз, и порог выделений памяти на блок
+#cmake -DBULKMT_ALLOCS=... -DINPUT=bulk1.txt -DREPEAT=1 -DWORK_DIR=... -DMAX_PER_BLOCK=N [-DARGS="--output;append"] -P allocs_test.cmake
+foreach(name BULKMT_ALLOCS INPUT REPEAT WORK_DIR MAX_PER_BLOCK)
+  if(NOT DEFINED ${name})
+    message(FATAL_ERROR "${name} is not set")
+  endif()
+endforeach()
+
+#каждый запуск пишет свои файлы в чистый каталог
+file(REMOVE_RECURSE ${WORK_DIR})
+file(MAKE_DIRECTORY ${WORK_DIR})
+
+#повтор дает устойчивый поток, где постоянные выделения при запуске не видны на фоне блоков
+#при повторе каждая копия дописывается до целых строк и закрытых блоков, чтобы копии не сливались в один блок
+file(READ ${INPUT} once)
+if(REPEAT GREATER 1 AND NOT once MATCHES "\n$")
+  set(once "${once}\n")
+endif()
+string(REPLACE "\n" ";" lines "${once}")
+set(depth 0)
+foreach(line IN LISTS lines)
+  if(line STREQUAL "{")
+    math(EXPR depth "${depth} + 1")
+  elseif(line STREQUAL "}" AND depth GREATER 0)
+    math(EXPR depth "${depth} - 1")
+  endif()
+endforeach()
+while(REPEAT GREATER 1 AND depth GREATER 0)
+  set(once "${once}}\n")
+  math(EXPR depth "${depth} - 1")
+endwhile()
+set(stream "")
+foreach(i RANGE 1 ${REPEAT})
+  set(stream "${stream}${once}")
+endforeach()
+file(WRITE ${WORK_DIR}/input.txt "${stream}")
+
+execute_process(COMMAND ${BULKMT_ALLOCS} 3 --quiet-paths ${ARGS}
+  INPUT_FILE ${WORK_DIR}/input.txt
+  OUTPUT_VARIABLE output
+  RESULT_VARIABLE result
+  WORKING_DIRECTORY ${WORK_DIR})
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "bulkmt_allocs exited with ${result}")
+endif()
+
+string(REGEX MATCH "Total allocations [0-9]+ bytes [0-9]+ per line [0-9.]+ per block ([0-9.]+)" total "${output}")
+if(NOT total)
+  message(FATAL_ERROR "no allocation totals in the output:\n${output}")
+endif()
+set(perBlock ${CMAKE_MATCH_1})
+message(STATUS "${total}")
+if(perBlock GREATER MAX_PER_BLOCK)
+  message(FATAL_ERROR "${perBlock} allocations per block, the limit is ${MAX_PER_BLOCK}")
+endif()
+file(REMOVE_RECURSE ${WORK_DIR})
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+
+//allocation counters of the hot path, filled by the counting operator new of allochook.cpp
+//only binaries linking allochook.cpp count (bulkmt_allocs, bulkmt_bench), everywhere else the counters stay 0
+//and the scopes below cost one thread local store per bulk
+//an allocation is charged to the site its thread is in right now, threads outside any scope count as Other
+enum class AllocSite : std::uint8_t
+{
+    Other = 0,
+    Parser = 1, //reading, assembling and publishing bulks, the sink queues included
+    Screen = 2, //ScreenWriter formatting and output
+    File = 3,   //FileWriter formatting, compression and output
+    Count = 4
+};
+
+struct AllocCounter
+{
+    std::atomic<std::uint64_t> count;
+    std::atomic<std::uint64_t> bytes;
+};
+
+//zero initialized before any constructor runs, so operator new may use them during static initialization
+inline AllocCounter *allocCounters()
+{
+    static AllocCounter counters[static_cast<std::size_t>(AllocSite::Count)];
+    return counters;
+}
+
+inline AllocSite &currentAllocSite()
+{
+    static thread_local AllocSite site = AllocSite::Other;
+    return site;
+}
+
+//set by allochook.cpp when it is linked in
+inline std::atomic<bool> &allocCounting()
+{
+    static std::atomic<bool> counting{false};
+    return counting;
+}
+
+inline void countAllocation(std::size_t size)
+{
+    AllocCounter &counter = allocCounters()[static_cast<std::size_t>(currentAllocSite())];
+    counter.count.fetch_add(1, std::memory_order_relaxed);
+    counter.bytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+//whatever was counted so far is forgotten, the run is measured from here
+inline void resetAllocations()
+{
+    for (std::size_t i = 0; i < static_cast<std::size_t>(AllocSite::Count); ++i)
+    {
+        allocCounters()[i].count.store(0, std::memory_order_relaxed);
+        allocCounters()[i].bytes.store(0, std::memory_order_relaxed);
+    }
+}
+
+//the counters at one moment, printed later without the printing itself being counted
+struct AllocTotals
+{
+    std::uint64_t count[static_cast<std::size_t>(AllocSite::Count)];
+    std::uint64_t bytes[static_cast<std::size_t>(AllocSite::Count)];
+
+    std::uint64_t totalCount() const
+    {
+        std::uint64_t total = 0;
+        for (std::uint64_t value : count)
+            total += value;
+        return total;
+    }
+
+    std::uint64_t totalBytes() const
+    {
+        std::uint64_t total = 0;
+        for (std::uint64_t value : bytes)
+            total += value;
+        return total;
+    }
+};
+
+inline AllocTotals allocationTotals()
+{
+    AllocTotals totals;
+    for (std::size_t i = 0; i < static_cast<std::size_t>(AllocSite::Count); ++i)
+    {
+        totals.count[i] = allocCounters()[i].count.load(std::memory_order_relaxed);
+        totals.bytes[i] = allocCounters()[i].bytes.load(std::memory_order_relaxed);
+    }
+    return totals;
+}
+
+//charges the allocations of the calling thread to site until the scope ends, scopes nest
+class AllocScope
+{
+public:
+    explicit AllocScope(AllocSite site) : m_previous(currentAllocSite())
+    {
+        currentAllocSite() = site;
+    }
+
+    ~AllocScope()
+    {
+        currentAllocSite() = m_previous;
+    }
+
+    AllocScope(const AllocScope &) = delete;
+    AllocScope &operator=(const AllocScope &) = delete;
+
+private:
+    AllocSite m_previous;
+};
+
+//"<thread id> Allocations N bytes M per line x per block y", lines and blocks as the parser counted them
+inline void printAllocations(const char *name, std::uint64_t count, std::uint64_t bytes, std::uint64_t lines, std::uint64_t blocks)
+{
+    std::cout << std::this_thread::get_id() << " " << name << " " << count << " bytes " << bytes << std::fixed
+              << std::setprecision(2) << " per line " << (lines ? static_cast<double>(count) / lines : 0.0) << " per block "
+              << (blocks ? static_cast<double>(count) / blocks : 0.0) << " bytes per block "
+              << (blocks ? static_cast<double>(bytes) / blocks : 0.0) << std::defaultfloat << std::endl;
+}
+
+inline void printAllocations(const AllocTotals &totals, AllocSite site, std::uint64_t lines, std::uint64_t blocks)
+{
+    std::size_t i = static_cast<std::size_t>(site);
+    printAllocations("Allocations", totals.count[i], totals.bytes[i], lines, blocks);
+}
+
+//every site together, Other included
+inline void printAllocations(const AllocTotals &totals, std::uint64_t lines, std::uint64_t blocks)
+{
+    printAllocations("Total allocations", totals.totalCount(), totals.totalBytes(), lines, blocks);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+//asynchronous writes out of buffers the I/O side owns, driven by a single thread
+//the caller fills a slot, queues it and goes on formatting; sync and close of a file wait for its queued writes
+//IoRing hands the slots to the kernel, IoPipe to an I/O thread
+class AsyncIo
+{
+public:
+    virtual ~AsyncIo() { }
+
+    virtual std::size_t slotSize() const = 0;
+    virtual char *slot(unsigned index) = 0;
+    virtual std::uint64_t errorCount() const = 0;
+
+    //a free slot to fill, waits for a completion when all of them are in flight
+    virtual unsigned acquire() = 0;
+    virtual void release(unsigned index) = 0;
+    //queues size bytes of the slot at offset of fd, the slot comes back to the free list once written
+    virtual void write(int fd, unsigned index, std::size_t size, std::uint64_t offset) = 0;
+    //fdatasync of fd once the writes queued so far have completed
+    virtual void sync(int fd) = 0;
+    //closes fd as soon as its last queued write completes
+    virtual void closeWhenDone(int fd) = 0;
+    //the queued work may start now, does not wait
+    virtual void submit() = 0;
+    //waits until every queued write has completed
+    virtual void drain() = 0;
+};
@@ -0,0 +1,192 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include "parser.h"
+#include "filewriter.h"
+
+struct StreamShape
+{
+    std::size_t lines = 500000;
+    std::size_t commandLength = 16;
+    int bulkSize = 10;
+    int depth = 1;            //braces opened around every block
+    double blockRatio = 0.1;  //share of bulks that are {} blocks instead of static ones
+    unsigned seed = 1;
+};
+
+//static runs of bulkSize commands mixed with blocks of bulkSize commands behind depth nested braces
+std::string generate(const StreamShape &shape)
+{
+    std::mt19937 random(shape.seed);
+    std::bernoulli_distribution block(shape.blockRatio);
+    std::uniform_int_distribution<int> letter('a', 'z');
+
+    std::string stream;
+    std::string command(shape.commandLength, 'x');
+    std::size_t lines = 0;
+    while (lines < shape.lines)
+    {
+        bool nested = block(random);
+        for (int i = 0; nested && i < shape.depth; ++i, ++lines)
+            stream.append("{\n");
+        for (int i = 0; i < shape.bulkSize; ++i, ++lines)
+        {
+            for (char &c : command)
+                c = static_cast<char>(letter(random));
+            stream.append(command).append("\n");
+        }
+        for (int i = 0; nested && i < shape.depth; ++i, ++lines)
+            stream.append("}\n");
+    }
+    return stream;
+}
+
+void removeLogs(const std::string &directory)
+{
+    DIR *dir = opendir(directory.c_str());
+    if (!dir)
+        return;
+    while (dirent *entry = readdir(dir))
+    {
+        std::string name = entry->d_name;
+        std::string suffix = name.size() > 4 ? name.substr(name.size() - 4) : std::string();
+        if (name.compare(0, 4, "bulk") == 0 && (suffix == ".log" || suffix == ".idx"))
+            ::unlink((directory + "/" + name).c_str());
+    }
+    closedir(dir);
+}
+
+struct Result
+{
+    double linesPerSecond;
+    double blocksPerSecond;
+    std::chrono::microseconds p50;
+    std::chrono::microseconds p99;
+    double allocationsPerBlock;
+};
+
+//parses the whole stream in 64k pieces like a pipe would deliver it and waits until every bulk is on disk
+template<template<typename> class Queue>
+Result run(const std::string &stream, const StreamShape &shape, OutputMode mode, int workers, IoBackend backend,
+           const std::string &directory)
+{
+    FileOutputOptions output;
+    output.mode = mode;
+    output.backend = backend;
+    output.directory = directory;
+    output.echoPaths = false;
+
+    std::uint64_t allocated;
+    std::uint64_t blocks;
+    std::uint64_t counts[WorkerStats::LatencyBuckets] = {};
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point end;
+    {
+        BasicFileWriter<Queue> writer(workers, 0, OverflowPolicy::Block, DispatchPolicy::RoundRobin, AutoscaleOptions(), output);
+        BasicParser<BasicFileWriter<Queue> > parser(std::tie(writer), shape.bulkSize, 1);
+
+        //every allocation of the process is counted by allochook.cpp, allocs/block is the delta over the run
+        allocated = allocationTotals().totalCount();
+        start = std::chrono::steady_clock::now();
+        for (std::size_t offset = 0; offset < stream.size(); offset += 64 * 1024)
+            parser.feed(stream.data() + offset, std::min<std::size_t>(64 * 1024, stream.size() - offset));
+        parser.finish();
+        writer.stop();
+        end = std::chrono::steady_clock::now();
+        allocated = allocationTotals().totalCount() - allocated;
+
+        blocks = parser.counters().blocks;
+        for (IWorker *worker : writer.workers())
+        {
+            for (std::size_t i = 0; i < WorkerStats::LatencyBuckets; ++i)
+                counts[i] += worker->stats().latency(i);
+        }
+    }
+    removeLogs(directory);
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+    Result result;
+    result.linesPerSecond = shape.lines / seconds;
+    result.blocksPerSecond = blocks / seconds;
+    result.p50 = WorkerStats::percentile(counts, 0.5);
+    result.p99 = WorkerStats::percentile(counts, 0.99);
+    result.allocationsPerBlock = blocks ? static_cast<double>(allocated) / blocks : 0;
+    return result;
+}
+
+void print(const char *queue, const char *output, const Result &result)
+{
+    std::printf("%-8s %-9s %12.0f %12.0f %9lld %9lld %12.2f\n", queue, output, result.linesPerSecond, result.blocksPerSecond,
+                static_cast<long long>(result.p50.count()), static_cast<long long>(result.p99.count()),
+                result.allocationsPerBlock);
+}
+
+//$ bulkmt_bench --lines 2000000 --command-length 32 --bulk-size 50 --depth 2 --block-ratio 0.25
+int main(int argc, const char *argv[])
+{
+    StreamShape shape;
+    int workers = 2;
+    IoBackend backend = IoBackend::Threads;
+    std::string directory = "/tmp";
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--lines" && hasValue)
+            shape.lines = std::strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--command-length" && hasValue)
+            shape.commandLength = std::strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--bulk-size" && hasValue)
+            shape.bulkSize = std::atoi(argv[++i]);
+        else if (arg == "--depth" && hasValue)
+            shape.depth = std::atoi(argv[++i]);
+        else if (arg == "--block-ratio" && hasValue)
+            shape.blockRatio = std::atof(argv[++i]);
+        else if (arg == "--seed" && hasValue)
+            shape.seed = std::strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--file-workers" && hasValue)
+            workers = std::atoi(argv[++i]);
+        else if (arg == "--io-backend" && hasValue)
+        {
+            std::string value = argv[++i];
+            backend = value == "uring" ? IoBackend::Uring : value == "pipe" ? IoBackend::Pipe : IoBackend::Threads;
+        }
+        else if (arg == "--dir" && hasValue)
+            directory = argv[++i];
+        else
+        {
+            std::cerr << "usage: " << argv[0] << " [--lines N] [--command-length N] [--bulk-size N] [--depth N]"
+                      << " [--block-ratio R] [--seed N] [--file-workers N] [--io-backend threads|uring|pipe] [--dir DIR]" << std::endl;
+            return 1;
+        }
+    }
+    if (shape.bulkSize <= 0 || shape.depth < 0 || shape.blockRatio < 0 || shape.blockRatio > 1 || workers <= 0)
+    {
+        std::cerr << "bulk size and file workers must be positive, block ratio within [0, 1]" << std::endl;
+        return 1;
+    }
+
+    std::string stream = generate(shape);
+    std::printf("%zu lines, %zu bytes, command length %zu, bulk size %d, depth %d, block ratio %.2f, %d file workers, %s\n",
+                shape.lines, stream.size(), shape.commandLength, shape.bulkSize, shape.depth, shape.blockRatio, workers,
+                backend == IoBackend::Uring ? "io_uring" : backend == IoBackend::Pipe ? "an I/O thread per worker" : "blocking writes");
+    std::printf("%-8s %-9s %12s %12s %9s %9s %12s\n", "queue", "output", "lines/s", "blocks/s", "p50 us", "p99 us", "allocs/block");
+
+    print("mutex", "per-bulk", run<MutexQueue>(stream, shape, OutputMode::PerBulk, workers, backend, directory));
+    print("mutex", "append", run<MutexQueue>(stream, shape, OutputMode::Append, workers, backend, directory));
+    print("spsc", "per-bulk", run<SpscQueue>(stream, shape, OutputMode::PerBulk, workers, backend, directory));
+    print("spsc", "append", run<SpscQueue>(stream, shape, OutputMode::Append, workers, backend, directory));
+    print("mpsc", "per-bulk", run<MpscQueue>(stream, shape, OutputMode::PerBulk, workers, backend, directory));
+    print("mpsc", "append", run<MpscQueue>(stream, shape, OutputMode::Append, workers, backend, directory));
+    return 0;
+}
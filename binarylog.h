@@ -0,0 +1,363 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef BULKMT_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "bulk.h"
+
+//binary command log: an 8 byte header, then framed records, the records may be one deflate stream
+//header:  "BLOG", version, codec, flags, a zero byte
+//record:  u32 payload length, u32 crc32 of the payload, payload
+//payload: u64 publish time in microseconds since the epoch, then Bulk::serialize
+//with BinaryLogSequence the time is followed by the u64 Bulk::sequence, bulkmt_decode --merge orders by it
+//with BinaryLogDictionary the rest of the payload is instead
+//         u32 definition count, (u32 id, u32 length, bytes)..., u32 command count, u32 ref...
+//         where a ref with the high bit set names a defined id and any other ref is a length followed by bytes;
+//         an interned command is defined in the first record of a file that uses it, so such a file is read from its start
+//integers are little endian, a record that fails its crc ends the readable part of a file
+
+enum class Compression
+{
+    None = 0,
+    Deflate = 1 //zlib stream flushed at every worker batch, needs a build with zlib
+};
+
+constexpr bool deflateAvailable()
+{
+#ifdef BULKMT_HAVE_ZLIB
+    return true;
+#else
+    return false;
+#endif
+}
+
+const std::size_t BinaryLogHeaderSize = 8;
+const std::uint8_t BinaryLogVersion = 1;
+const std::uint32_t MaxRecordPayload = 1u << 30;
+const std::uint8_t BinaryLogDictionary = 1; //header flag: records reference interned commands
+const std::uint8_t BinaryLogSequence = 2;   //header flag: records carry the bulk sequence
+const std::uint32_t DictionaryRef = 1u << 31;
+
+inline void appendBinaryLogHeader(std::string &out, Compression compression, std::uint8_t flags)
+{
+    const char header[BinaryLogHeaderSize] = { 'B', 'L', 'O', 'G', static_cast<char>(BinaryLogVersion),
+                                               static_cast<char>(compression), static_cast<char>(flags), 0 };
+    out.append(header, sizeof(header));
+}
+
+//false when data is not a binary log header this version understands
+inline bool readBinaryLogHeader(const char *data, std::size_t size, Compression &compression, std::uint8_t &flags)
+{
+    if (size < BinaryLogHeaderSize || std::memcmp(data, "BLOG", 4) != 0 || static_cast<std::uint8_t>(data[4]) != BinaryLogVersion)
+        return false;
+    if (data[5] != static_cast<char>(Compression::None) && data[5] != static_cast<char>(Compression::Deflate))
+        return false;
+    compression = static_cast<Compression>(data[5]);
+    flags = static_cast<std::uint8_t>(data[6]);
+    return (flags & ~(BinaryLogDictionary | BinaryLogSequence)) == 0;
+}
+
+//crc-32 (ieee, reflected), the same value as zlib crc32()
+inline std::uint32_t recordCrc32(const char *data, std::size_t size, std::uint32_t crc = 0)
+{
+    struct Table
+    {
+        std::uint32_t entries[256];
+
+        Table()
+        {
+            for (std::uint32_t i = 0; i < 256; ++i)
+            {
+                std::uint32_t value = i;
+                for (int bit = 0; bit < 8; ++bit)
+                    value = value & 1 ? 0xEDB88320u ^ (value >> 1) : value >> 1;
+                entries[i] = value;
+            }
+        }
+    };
+    static const Table table;
+
+    crc = ~crc;
+    for (std::size_t i = 0; i < size; ++i)
+        crc = table.entries[(crc ^ static_cast<std::uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+inline void appendLittleEndian(std::string &out, std::uint64_t value, std::size_t bytes)
+{
+    for (std::size_t i = 0; i < bytes; ++i)
+        out.push_back(static_cast<char>(value >> (8 * i)));
+}
+
+inline std::uint64_t readLittleEndian(const char *data, std::size_t bytes)
+{
+    std::uint64_t value = 0;
+    for (std::size_t i = 0; i < bytes; ++i)
+        value |= static_cast<std::uint64_t>(static_cast<std::uint8_t>(data[i])) << (8 * i);
+    return value;
+}
+
+//the wall clock time the bulk was published at, the parser only keeps a steady clock stamp
+inline std::uint64_t publishedMicros(const Bulk &commands)
+{
+    auto now = std::chrono::system_clock::now();
+    if (commands.publishedAt() != std::chrono::steady_clock::time_point())
+        now -= std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::steady_clock::now() - commands.publishedAt());
+    return std::chrono::duration_cast<std::chrono::microseconds>(now.time_since_epoch()).count();
+}
+
+//defined holds the dictionary ids the current file has seen, nullptr writes a record without references
+//sequence matches BinaryLogSequence in the header of the file
+inline void appendBinaryRecord(std::string &out, const Bulk &commands, std::vector<bool> *defined = nullptr,
+                               bool sequence = false)
+{
+    std::size_t frame = out.size();
+    out.append(8, '\0'); //length and crc, known once the payload is in place
+    appendLittleEndian(out, publishedMicros(commands), 8);
+    if (sequence)
+        appendLittleEndian(out, commands.sequence(), 8);
+    if (!defined)
+        commands.serialize(out);
+    else
+    {
+        std::size_t definitions = out.size();
+        std::uint32_t count = 0;
+        out.append(4, '\0');
+        for (std::size_t i = 0; i < commands.size(); ++i)
+        {
+            std::uint32_t id = commands.id(i);
+            if (id == 0 || id >= DictionaryRef || (id < defined->size() && (*defined)[id]))
+                continue;
+            if (id >= defined->size())
+                defined->resize(std::max<std::size_t>(id + 1, defined->size() * 2));
+            (*defined)[id] = true;
+            appendLittleEndian(out, id, 4);
+            appendLittleEndian(out, commands[i].size(), 4);
+            out.append(commands[i].data(), commands[i].size());
+            ++count;
+        }
+        std::string prefix;
+        appendLittleEndian(prefix, count, 4);
+        out.replace(definitions, 4, prefix);
+
+        appendLittleEndian(out, commands.size(), 4);
+        for (std::size_t i = 0; i < commands.size(); ++i)
+        {
+            std::uint32_t id = commands.id(i);
+            if (id != 0 && id < DictionaryRef)
+                appendLittleEndian(out, DictionaryRef | id, 4);
+            else
+            {
+                appendLittleEndian(out, commands[i].size(), 4);
+                out.append(commands[i].data(), commands[i].size());
+            }
+        }
+    }
+
+    std::size_t payload = out.size() - frame - 8;
+    std::string prefix;
+    appendLittleEndian(prefix, payload, 4);
+    appendLittleEndian(prefix, recordCrc32(out.data() + frame + 8, payload), 4);
+    out.replace(frame, 8, prefix);
+}
+
+//splits a record stream fed in arbitrary pieces
+class RecordReader
+{
+public:
+    explicit RecordReader(std::uint8_t flags = 0) : m_flags(flags), m_pos(0), m_offset(0), m_bad(false) { }
+
+    void feed(const char *data, std::size_t size)
+    {
+        //consumed bytes are dropped only once they are the larger part of the buffer
+        if (m_pos > m_buffer.size() / 2)
+        {
+            m_buffer.erase(0, m_pos);
+            m_pos = 0;
+        }
+        m_buffer.append(data, size);
+    }
+
+    //false when no complete record is buffered, bad() tells a corrupt record from a missing tail
+    //the bulk gets the record's sequence, 0 in a file without BinaryLogSequence
+    bool next(Bulk &commands, std::uint64_t &micros)
+    {
+        if (m_bad || m_buffer.size() - m_pos < 8)
+            return false;
+
+        const char *frame = m_buffer.data() + m_pos;
+        std::size_t prefix = m_flags & BinaryLogSequence ? 16 : 8; //time and sequence
+        std::uint32_t payload = static_cast<std::uint32_t>(readLittleEndian(frame, 4));
+        if (payload < prefix + 4 || payload > MaxRecordPayload)
+            return fail();
+        if (m_buffer.size() - m_pos - 8 < payload)
+            return false;
+        if (recordCrc32(frame + 8, payload) != static_cast<std::uint32_t>(readLittleEndian(frame + 4, 4)))
+            return fail();
+        const char *body = frame + 8 + prefix;
+        bool parsed = m_flags & BinaryLogDictionary ? parseReferences(body, frame + 8 + payload, commands)
+                                                    : commands.deserialize(body, payload - prefix);
+        if (!parsed)
+            return fail();
+
+        micros = readLittleEndian(frame + 8, 8);
+        commands.number(prefix == 16 ? readLittleEndian(frame + 16, 8) : 0);
+        m_pos += 8 + payload;
+        m_offset += 8 + payload;
+        return true;
+    }
+
+    bool bad() const { return m_bad; }
+    std::size_t pending() const { return m_buffer.size() - m_pos; } //a truncated tail once the input is over
+    std::uint64_t offset() const { return m_offset; }               //of the next record in the record stream
+
+private:
+    bool fail()
+    {
+        m_bad = true;
+        return false;
+    }
+
+    static bool readU32(const char *&data, const char *end, std::uint32_t &value)
+    {
+        if (end - data < 4)
+            return false;
+        value = static_cast<std::uint32_t>(readLittleEndian(data, 4));
+        data += 4;
+        return true;
+    }
+
+    bool parseReferences(const char *data, const char *end, Bulk &commands)
+    {
+        commands.clear();
+        std::uint32_t definitions, count, id, length;
+        if (!readU32(data, end, definitions))
+            return false;
+        for (std::uint32_t i = 0; i < definitions; ++i)
+        {
+            if (!readU32(data, end, id) || !readU32(data, end, length) || id == 0 || id >= DictionaryRef
+                    || static_cast<std::size_t>(end - data) < length)
+                return false;
+            if (id >= m_dictionary.size())
+                m_dictionary.resize(id + 1);
+            m_dictionary[id].assign(data, length);
+            data += length;
+        }
+
+        if (!readU32(data, end, count))
+            return false;
+        for (std::uint32_t i = 0; i < count; ++i)
+        {
+            std::uint32_t ref;
+            if (!readU32(data, end, ref))
+                return false;
+            if (ref & DictionaryRef)
+            {
+                id = ref & ~DictionaryRef;
+                if (id >= m_dictionary.size())
+                    return false; //a reference to a definition that was never written
+                commands.push_back(m_dictionary[id]);
+            }
+            else
+            {
+                if (static_cast<std::size_t>(end - data) < ref)
+                    return false;
+                commands.push_back(data, ref);
+                data += ref;
+            }
+        }
+        return data == end;
+    }
+
+    std::uint8_t m_flags;
+    std::vector<std::string> m_dictionary; //interned commands defined so far, by id
+    std::string m_buffer;
+    std::size_t m_pos;
+    std::uint64_t m_offset;
+    bool m_bad;
+};
+
+#ifdef BULKMT_HAVE_ZLIB
+//one deflate stream per file on top of some byte sink, Output is called with every compressed piece
+class LogDeflater
+{
+public:
+    explicit LogDeflater(int level = 1)
+        : m_out(64 * 1024)
+    {
+        std::memset(&m_stream, 0, sizeof(m_stream));
+        deflateInit(&m_stream, level);
+    }
+
+    ~LogDeflater()
+    {
+        deflateEnd(&m_stream);
+    }
+
+    LogDeflater(const LogDeflater &) = delete;
+    LogDeflater &operator=(const LogDeflater &) = delete;
+
+    template<typename Output>
+    void write(const char *data, std::size_t size, Output &&output)
+    {
+        run(data, size, Z_NO_FLUSH, output);
+    }
+
+    //everything written so far becomes decodable
+    template<typename Output>
+    void flush(Output &&output)
+    {
+        if (m_dirty)
+            run(nullptr, 0, Z_SYNC_FLUSH, output);
+        m_dirty = false;
+    }
+
+    //ends the stream of the current file, the next write starts a new one
+    template<typename Output>
+    void finish(Output &&output)
+    {
+        run(nullptr, 0, Z_FINISH, output);
+        deflateReset(&m_stream);
+        m_dirty = false;
+    }
+
+private:
+    template<typename Output>
+    void run(const char *data, std::size_t size, int mode, Output &output)
+    {
+        m_stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+        m_stream.avail_in = static_cast<uInt>(size);
+        m_dirty = m_dirty || size != 0;
+        do
+        {
+            m_stream.next_out = reinterpret_cast<Bytef *>(m_out.data());
+            m_stream.avail_out = static_cast<uInt>(m_out.size());
+            deflate(&m_stream, mode);
+            output(m_out.data(), m_out.size() - m_stream.avail_out);
+        }
+        while (m_stream.avail_out == 0 || m_stream.avail_in != 0);
+    }
+
+    z_stream m_stream;
+    std::vector<char> m_out;
+    bool m_dirty = false;
+};
+#else
+//never constructed without zlib, Compression::Deflate is refused up front
+class LogDeflater
+{
+public:
+    explicit LogDeflater(int = 1) { }
+
+    template<typename Output> void write(const char *, std::size_t, Output &&) { }
+    template<typename Output> void flush(Output &&) { }
+    template<typename Output> void finish(Output &&) { }
+};
+#endif
@@ -0,0 +1,520 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+//non-owning view of one command stored inside a bulk arena
+class CommandRef
+{
+public:
+    CommandRef(const char *data, std::size_t size) : m_data(data), m_size(size) { }
+
+    const char *data() const { return m_data; }
+    std::size_t size() const { return m_size; }
+    std::string str() const { return std::string(m_data, m_size); }
+
+    bool operator==(const CommandRef &other) const
+    {
+        return m_size == other.m_size && std::memcmp(m_data, other.m_data, m_size) == 0;
+    }
+    bool operator!=(const CommandRef &other) const { return !(*this == other); }
+
+private:
+    const char *m_data;
+    std::size_t m_size;
+};
+
+inline std::ostream &operator<<(std::ostream &os, const CommandRef &command)
+{
+    return os.write(command.data(), command.size());
+}
+
+//maps repeated commands to ids, a bulk then keeps an id and a pointer instead of a copy of the bytes
+//interning is done by one thread at a time; the bytes of an interned command never move, so bulks read them
+//from any thread without locks while the dictionary lives
+//once maxEntries commands are known new ones are no longer interned, long commands never are
+class CommandDictionary
+{
+public:
+    explicit CommandDictionary(std::size_t maxEntries = 1 << 16, std::size_t maxCommandSize = 256)
+        : m_maxEntries(std::min<std::size_t>(maxEntries, 0x7FFFFFFF))
+        , m_maxCommandSize(maxCommandSize)
+        , m_slots(tableSize(m_maxEntries), 0)
+        , m_chunkUsed(ChunkSize)
+    { }
+
+    CommandDictionary(const CommandDictionary &) = delete;
+    CommandDictionary &operator=(const CommandDictionary &) = delete;
+
+    //id of the command, 0 when it is not interned
+    std::uint32_t intern(const char *data, std::size_t size)
+    {
+        if (size > m_maxCommandSize)
+            return 0;
+
+        std::size_t mask = m_slots.size() - 1;
+        for (std::size_t slot = hash(data, size) & mask;; slot = (slot + 1) & mask)
+        {
+            std::uint32_t id = m_slots[slot];
+            if (id == 0)
+            {
+                if (m_commands.size() == m_maxEntries)
+                    return 0;
+                m_commands.push_back(CommandRef(store(data, size), size));
+                m_slots[slot] = static_cast<std::uint32_t>(m_commands.size());
+                return m_slots[slot];
+            }
+            if (m_commands[id - 1] == CommandRef(data, size))
+                return id;
+        }
+    }
+
+    //by the interning thread only
+    CommandRef command(std::uint32_t id) const { return m_commands[id - 1]; }
+    std::size_t size() const { return m_commands.size(); }
+
+private:
+    static const std::size_t ChunkSize = 64 * 1024;
+
+    //the table stays at most half full
+    static std::size_t tableSize(std::size_t entries)
+    {
+        std::size_t size = 16;
+        while (size < entries * 2)
+            size <<= 1;
+        return size;
+    }
+
+    static std::size_t hash(const char *data, std::size_t size)
+    {
+        std::uint64_t value = 14695981039346656037ull; //fnv-1a
+        for (std::size_t i = 0; i < size; ++i)
+            value = (value ^ static_cast<std::uint8_t>(data[i])) * 1099511628211ull;
+        return static_cast<std::size_t>(value ^ (value >> 32));
+    }
+
+    const char *store(const char *data, std::size_t size)
+    {
+        //m_chunkUsed starts at ChunkSize, but an empty command fits even then and still needs a chunk to point into
+        if (m_chunks.empty() || m_chunkUsed + size > ChunkSize)
+        {
+            m_chunks.emplace_back(new char[size > ChunkSize ? size : ChunkSize]);
+            m_chunkUsed = 0;
+        }
+        char *stored = m_chunks.back().get() + m_chunkUsed;
+        std::memcpy(stored, data, size);
+        m_chunkUsed += size;
+        return stored;
+    }
+
+    std::size_t m_maxEntries;
+    std::size_t m_maxCommandSize;
+    std::vector<std::uint32_t> m_slots; //open addressing, ids start at 1
+    std::vector<CommandRef> m_commands;
+    std::vector<std::unique_ptr<char[]> > m_chunks;
+    std::size_t m_chunkUsed;
+};
+
+//all command bytes of a bulk live in one contiguous arena, commands are addressed by offset/length
+//interned commands are not copied, their entry points into the CommandDictionary instead
+class Bulk
+{
+    struct Entry
+    {
+        union
+        {
+            std::size_t offset;   //into the arena, id == 0
+            const char *interned; //dictionary bytes, id != 0
+        };
+        std::uint32_t size;
+        std::uint32_t id;
+    };
+
+public:
+    class const_iterator
+    {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = CommandRef;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = CommandRef;
+
+        const_iterator(const Bulk *bulk, std::size_t pos) : m_bulk(bulk), m_pos(pos) { }
+
+        CommandRef operator*() const { return (*m_bulk)[m_pos]; }
+        const_iterator &operator++() { ++m_pos; return *this; }
+        const_iterator operator++(int) { const_iterator tmp(*this); ++m_pos; return tmp; }
+        bool operator==(const const_iterator &other) const { return m_pos == other.m_pos; }
+        bool operator!=(const const_iterator &other) const { return m_pos != other.m_pos; }
+
+    private:
+        const Bulk *m_bulk;
+        std::size_t m_pos;
+    };
+
+    void push_back(const std::string &command)
+    {
+        push_back(command.data(), command.size());
+    }
+
+    void push_back(const char *data, std::size_t size)
+    {
+        Entry entry;
+        entry.offset = m_arena.size();
+        entry.size = static_cast<std::uint32_t>(size);
+        entry.id = 0;
+        m_index.push_back(entry);
+        m_arena.insert(m_arena.end(), data, data + size);
+        m_bytes += size;
+    }
+
+    //an interned command, the dictionary must outlive the bulk
+    void push_back(const CommandRef &command, std::uint32_t id)
+    {
+        Entry entry;
+        entry.interned = command.data();
+        entry.size = static_cast<std::uint32_t>(command.size());
+        entry.id = id;
+        m_index.push_back(entry);
+        m_bytes += command.size();
+    }
+
+    //keeps arena and index capacity, so a recycled bulk does not allocate again
+    void clear()
+    {
+        m_arena.clear();
+        m_index.clear();
+        m_bytes = 0;
+    }
+
+    CommandRef operator[](std::size_t pos) const
+    {
+        const Entry &entry = m_index[pos];
+        return CommandRef(entry.id ? entry.interned : m_arena.data() + entry.offset, entry.size);
+    }
+
+    //CommandDictionary id of a command, 0 when its bytes are in the arena
+    std::uint32_t id(std::size_t pos) const { return m_index[pos].id; }
+
+    std::size_t size() const { return m_index.size(); }
+    bool empty() const { return m_index.empty(); }
+    //copies all commands of other to the end of this bulk
+    void append(const Bulk &other)
+    {
+        std::size_t base = m_arena.size();
+        m_arena.insert(m_arena.end(), other.m_arena.begin(), other.m_arena.end());
+        for (Entry entry : other.m_index)
+        {
+            if (entry.id == 0)
+                entry.offset += base;
+            m_index.push_back(entry);
+        }
+        m_bytes += other.m_bytes;
+    }
+
+    std::size_t bytes() const { return m_bytes; } //of all commands, interned ones included
+    std::size_t capacity() const { return m_arena.capacity(); }
+
+    //set by the parser when the bulk is published, delivery latency is measured from it
+    void stamp(std::chrono::steady_clock::time_point publishedAt) { m_publishedAt = publishedAt; }
+    std::chrono::steady_clock::time_point publishedAt() const { return m_publishedAt; }
+
+    //position in the parser's output, 1 for its first bulk; parsers sharing counters number their bulks together
+    //0 is a bulk that never went through a parser
+    void number(std::uint64_t sequence) { m_sequence = sequence; }
+    std::uint64_t sequence() const { return m_sequence; }
+
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, m_index.size()); }
+
+    //flat record: command count, then length-prefixed commands, interned ones are written out in full
+    void serialize(std::string &out) const
+    {
+        appendU32(out, static_cast<std::uint32_t>(m_index.size()));
+        for (const CommandRef &command : *this)
+        {
+            appendU32(out, static_cast<std::uint32_t>(command.size()));
+            out.append(command.data(), command.size());
+        }
+    }
+
+    bool deserialize(const char *data, std::size_t size)
+    {
+        clear();
+        const char *end = data + size;
+        std::uint32_t count;
+        if (!readU32(data, end, count))
+            return false;
+
+        for (std::uint32_t i = 0; i < count; ++i)
+        {
+            std::uint32_t length;
+            if (!readU32(data, end, length) || static_cast<std::size_t>(end - data) < length)
+                return false;
+            push_back(data, length);
+            data += length;
+        }
+        return true;
+    }
+
+private:
+    static void appendU32(std::string &out, std::uint32_t value)
+    {
+        char bytes[sizeof(value)];
+        std::memcpy(bytes, &value, sizeof(value));
+        out.append(bytes, sizeof(value));
+    }
+
+    static bool readU32(const char *&data, const char *end, std::uint32_t &value)
+    {
+        if (static_cast<std::size_t>(end - data) < sizeof(value))
+            return false;
+        std::memcpy(&value, data, sizeof(value));
+        data += sizeof(value);
+        return true;
+    }
+
+    std::vector<char> m_arena;
+    std::vector<Entry> m_index;
+    std::size_t m_bytes = 0;
+    std::chrono::steady_clock::time_point m_publishedAt;
+    std::uint64_t m_sequence = 0;
+};
+
+using BulkPtr = std::shared_ptr<const Bulk>; //bulk is built once and shared read-only by all subscribers
+
+//hands out empty bulks and takes them back once the last subscriber dropped its reference
+class BulkPool : public std::enable_shared_from_this<BulkPool>
+{
+public:
+    static std::shared_ptr<BulkPool> create(std::size_t maxCached = 64, std::size_t maxArenaBytes = 1 << 20)
+    {
+        return std::shared_ptr<BulkPool>(new BulkPool(maxCached, maxArenaBytes));
+    }
+
+    std::unique_ptr<Bulk> acquire()
+    {
+        {
+            std::lock_guard<std::mutex> lk(m_mutex);
+            if (!m_free.empty())
+            {
+                std::unique_ptr<Bulk> bulk = std::move(m_free.back());
+                m_free.pop_back();
+                return bulk;
+            }
+        }
+        return std::unique_ptr<Bulk>(new Bulk());
+    }
+
+    //freezes a filled bulk, it returns to the pool when the last BulkPtr copy is gone
+    BulkPtr share(std::unique_ptr<Bulk> bulk)
+    {
+        std::weak_ptr<BulkPool> pool = shared_from_this();
+        return BulkPtr(bulk.release(), [pool](const Bulk *released)
+        {
+            std::unique_ptr<Bulk> owned(const_cast<Bulk *>(released));
+            if (auto alive = pool.lock())
+                alive->release(std::move(owned));
+        });
+    }
+
+private:
+    BulkPool(std::size_t maxCached, std::size_t maxArenaBytes)
+        : m_maxCached(maxCached)
+        , m_maxArenaBytes(maxArenaBytes)
+    { }
+
+    void release(std::unique_ptr<Bulk> bulk)
+    {
+        if (bulk->capacity() > m_maxArenaBytes) //do not pin memory of one huge block forever
+            return;
+
+        bulk->clear();
+        std::lock_guard<std::mutex> lk(m_mutex);
+        if (m_free.size() < m_maxCached)
+            m_free.push_back(std::move(bulk));
+    }
+
+    std::mutex m_mutex;
+    std::vector<std::unique_ptr<Bulk> > m_free;
+    std::size_t m_maxCached;
+    std::size_t m_maxArenaBytes;
+};
+
+//text form of a bulk shared by all writers: "bulk:cmd1 cmd2 \n"
+inline void appendBulkText(std::string &out, const Bulk &commands)
+{
+    out.append("bulk:");
+    for (const auto &command : commands)
+    {
+        out.append(command.data(), command.size());
+        out.push_back(' ');
+    }
+    out.push_back('\n');
+}
+
+//fifo of serialized records in an unlinked temporary file, used when a bounded queue overflows
+class SpillFile
+{
+public:
+    SpillFile() : m_file(nullptr), m_readPos(0), m_writePos(0), m_pending(0) { }
+
+    ~SpillFile()
+    {
+        if (m_file)
+            std::fclose(m_file);
+    }
+
+    SpillFile(const SpillFile &) = delete;
+    SpillFile &operator=(const SpillFile &) = delete;
+
+    bool push(const std::string &record)
+    {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        if (!m_file && !(m_file = std::tmpfile()))
+            return false;
+
+        std::uint32_t length = static_cast<std::uint32_t>(record.size());
+        if (fseeko(m_file, m_writePos, SEEK_SET) != 0
+                || std::fwrite(&length, sizeof(length), 1, m_file) != 1
+                || std::fwrite(record.data(), 1, record.size(), m_file) != record.size())
+            return false;
+
+        m_writePos += sizeof(length) + record.size();
+        m_pending++;
+        return true;
+    }
+
+    bool pop(std::string &record)
+    {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        if (m_pending == 0)
+            return false;
+
+        std::uint32_t length;
+        std::fflush(m_file);
+        if (fseeko(m_file, m_readPos, SEEK_SET) != 0 || std::fread(&length, sizeof(length), 1, m_file) != 1)
+            return false;
+        record.resize(length);
+        if (std::fread(&record[0], 1, length, m_file) != length)
+            return false;
+
+        m_readPos += sizeof(length) + length;
+        if (--m_pending == 0)
+            m_readPos = m_writePos = 0; //reuse the file from the start once it is drained
+        return true;
+    }
+
+    std::size_t pending()
+    {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        return m_pending;
+    }
+
+private:
+    std::mutex m_mutex;
+    std::FILE *m_file;
+    off_t m_readPos;
+    off_t m_writePos;
+    std::size_t m_pending;
+};
+
+//how a queued item is written to and restored from a spill file
+template<typename T>
+struct SpillTraits;
+
+template<>
+struct SpillTraits<BulkPtr>
+{
+    //the publish stamp and the sequence go first, so latency stats and ordering still cover bulks that waited on disk
+    static void save(const BulkPtr &bulk, std::string &record)
+    {
+        std::chrono::steady_clock::rep stamp = bulk->publishedAt().time_since_epoch().count();
+        std::uint64_t sequence = bulk->sequence();
+        record.append(reinterpret_cast<const char *>(&stamp), sizeof(stamp));
+        record.append(reinterpret_cast<const char *>(&sequence), sizeof(sequence));
+        bulk->serialize(record);
+    }
+
+    static bool load(const std::string &record, BulkPtr &bulk)
+    {
+        std::chrono::steady_clock::rep stamp;
+        std::uint64_t sequence;
+        const std::size_t prefix = sizeof(stamp) + sizeof(sequence);
+        std::shared_ptr<Bulk> restored = std::make_shared<Bulk>();
+        if (record.size() < prefix || !restored->deserialize(record.data() + prefix, record.size() - prefix))
+            return false;
+        std::memcpy(&stamp, record.data(), sizeof(stamp));
+        std::memcpy(&sequence, record.data() + sizeof(stamp), sizeof(sequence));
+        restored->stamp(std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(stamp)));
+        restored->number(sequence);
+        bulk = std::move(restored);
+        return true;
+    }
+};
+
+//bytes an item keeps in memory while it waits in a queue, used for load-aware dispatch
+template<typename T>
+std::size_t payloadBytes(const T &)
+{
+    return sizeof(T);
+}
+
+inline std::size_t payloadBytes(const BulkPtr &bulk)
+{
+    return bulk->bytes();
+}
+
+//commands in an item, counted by the worker stats
+template<typename T>
+std::size_t payloadCount(const T &)
+{
+    return 1;
+}
+
+inline std::size_t payloadCount(const BulkPtr &bulk)
+{
+    return bulk->size();
+}
+
+//when an item was published, a default time point leaves it out of the latency histogram
+template<typename T>
+std::chrono::steady_clock::time_point payloadStamp(const T &)
+{
+    return std::chrono::steady_clock::time_point();
+}
+
+inline std::chrono::steady_clock::time_point payloadStamp(const BulkPtr &bulk)
+{
+    return bulk->publishedAt();
+}
+
+//what Worker::push_back does when its bounded queue is full
+enum class OverflowPolicy
+{
+    Block = 0,      //producer waits for the consumer
+    DropOldest = 1, //oldest queued item is discarded
+    Spill = 2       //item goes to a temporary file and is read back in order
+};
+
+inline const char *overflowPolicyName(OverflowPolicy policy)
+{
+    switch (policy)
+    {
+    case OverflowPolicy::Block: return "block";
+    case OverflowPolicy::DropOldest: return "drop-oldest";
+    case OverflowPolicy::Spill: return "spill";
+    }
+    return "unknown";
+}
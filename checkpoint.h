@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "binarylog.h"
+
+//bulks a sink did not write before the drain deadline, kept for the next run
+//every sink has its own file PATH.<sink> in the binary log format, uncompressed and without a dictionary,
+//so bulkmt_decode reads it as well; replay is at least once: a part stays on disk until the next save
+//replaces it, a run that crashes before its stop replays the same bulks again
+class Checkpoint
+{
+public:
+    explicit Checkpoint(const std::string &path) : m_path(path) { }
+
+    std::string path(const std::string &sink) const
+    {
+        return m_path + "." + sink;
+    }
+
+    //the part the previous run left for sink, empty when there is none or it is unreadable
+    //the bulks are stamped now, their latency counts from the replay; they keep no sequence, theirs belonged
+    //to the run that parsed them
+    std::vector<BulkPtr> load(const std::string &sink) const
+    {
+        std::vector<BulkPtr> bulks;
+        int fd = ::open(path(sink).c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return bulks;
+
+        char header[BinaryLogHeaderSize];
+        Compression compression;
+        std::uint8_t flags;
+        if (readAll(fd, header, sizeof(header)) != sizeof(header)
+                || !readBinaryLogHeader(header, sizeof(header), compression, flags)
+                || compression != Compression::None || flags != 0)
+        {
+            ::close(fd);
+            return bulks;
+        }
+
+        RecordReader reader;
+        std::vector<char> input(64 * 1024);
+        auto now = std::chrono::steady_clock::now();
+        for (ssize_t got; (got = readAll(fd, input.data(), input.size())) > 0;)
+        {
+            reader.feed(input.data(), static_cast<std::size_t>(got));
+            std::shared_ptr<Bulk> bulk = std::make_shared<Bulk>();
+            for (std::uint64_t micros; reader.next(*bulk, micros); bulk = std::make_shared<Bulk>())
+            {
+                bulk->stamp(now);
+                bulks.push_back(std::move(bulk));
+            }
+        }
+        ::close(fd);
+        return bulks;
+    }
+
+    //replaces the part of sink, no bulks remove it; false when the new part could not be written
+    //the file is synced and renamed into place, a crash leaves either the old part or the new one
+    bool save(const std::string &sink, const std::vector<BulkPtr> &bulks) const
+    {
+        std::string target = path(sink);
+        if (bulks.empty())
+            return ::unlink(target.c_str()) == 0 || errno == ENOENT;
+
+        std::string temporary = target + ".tmp";
+        int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return false;
+
+        std::string out;
+        appendBinaryLogHeader(out, Compression::None, 0);
+        bool written = true;
+        for (std::size_t i = 0; written && i < bulks.size(); ++i)
+        {
+            appendBinaryRecord(out, *bulks[i]);
+            if (out.size() >= 1 << 20 || i + 1 == bulks.size())
+            {
+                written = writeAll(fd, out.data(), out.size());
+                out.clear();
+            }
+        }
+        written = written && ::fdatasync(fd) == 0;
+        written = ::close(fd) == 0 && written;
+        if (written && std::rename(temporary.c_str(), target.c_str()) == 0)
+            return true;
+        ::unlink(temporary.c_str());
+        return false;
+    }
+
+private:
+    static ssize_t readAll(int fd, char *data, std::size_t size)
+    {
+        std::size_t done = 0;
+        while (done < size)
+        {
+            ssize_t got = ::read(fd, data + done, size - done);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got <= 0)
+                return done ? static_cast<ssize_t>(done) : got;
+            done += static_cast<std::size_t>(got);
+        }
+        return static_cast<ssize_t>(done);
+    }
+
+    static bool writeAll(int fd, const char *data, std::size_t size)
+    {
+        while (size > 0)
+        {
+            ssize_t written = ::write(fd, data, size);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            data += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    std::string m_path;
+};
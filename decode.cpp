@@ -0,0 +1,290 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "binarylog.h"
+
+struct DecodeOptions
+{
+    bool time = false;  //prefix every bulk with its publish time in microseconds since the epoch
+    bool check = false; //only verify the records, print their count
+    bool merge = false; //one stream of all files in bulk sequence order
+};
+
+//the records of one log, read and inflated piece by piece as they are asked for
+class LogSource
+{
+public:
+    explicit LogSource(const char *path)
+        : m_path(path)
+        , m_input(64 * 1024)
+    { }
+
+    ~LogSource()
+    {
+        if (m_file)
+            std::fclose(m_file);
+#ifdef BULKMT_HAVE_ZLIB
+        if (m_inflating)
+            inflateEnd(&m_stream);
+#endif
+    }
+
+    LogSource(const LogSource &) = delete;
+    LogSource &operator=(const LogSource &) = delete;
+
+    bool open()
+    {
+        m_file = std::fopen(m_path, "rb");
+        if (!m_file)
+        {
+            std::cerr << m_path << ": " << std::strerror(errno) << std::endl;
+            return false;
+        }
+
+        char header[BinaryLogHeaderSize];
+        if (std::fread(header, 1, sizeof(header), m_file) != sizeof(header)
+                || !readBinaryLogHeader(header, sizeof(header), m_compression, m_flags))
+        {
+            std::cerr << m_path << ": not a binary bulk log" << std::endl;
+            return false;
+        }
+        if (m_compression == Compression::Deflate && !deflateAvailable())
+        {
+            std::cerr << m_path << ": compressed, bulkmt_decode is built without zlib" << std::endl;
+            return false;
+        }
+
+        m_reader = RecordReader(m_flags);
+#ifdef BULKMT_HAVE_ZLIB
+        if (m_compression == Compression::Deflate)
+        {
+            std::memset(&m_stream, 0, sizeof(m_stream));
+            inflateInit(&m_stream);
+            m_inflating = true;
+            m_output.resize(256 * 1024);
+        }
+#endif
+        return true;
+    }
+
+    bool sequenced() const { return m_flags & BinaryLogSequence; }
+
+    //false at the end of the log or at a broken record, valid() tells them apart
+    bool next(Bulk &commands, std::uint64_t &micros)
+    {
+        while (!m_reader.next(commands, micros))
+        {
+            if (m_reader.bad() || !m_valid || !read())
+                return false;
+        }
+        ++m_records;
+        m_commands += commands.size();
+        return true;
+    }
+
+    bool valid() const { return m_valid && !m_reader.bad() && m_reader.pending() == 0; }
+
+    //what is wrong with the log once next returned false
+    void report() const
+    {
+        if (m_reader.bad())
+            std::cerr << m_path << ": bad record at offset " << m_reader.offset() << " after record " << m_records << std::endl;
+        else if (m_valid && m_reader.pending() != 0)
+            std::cerr << m_path << ": truncated record at offset " << m_reader.offset() << ", " << m_reader.pending() << " bytes"
+                      << std::endl;
+    }
+
+    const char *path() const { return m_path; }
+    std::uint64_t records() const { return m_records; }
+    std::uint64_t commands() const { return m_commands; }
+
+private:
+    //feeds the reader one more piece of the file, false once the file is over
+    bool read()
+    {
+        std::size_t got = std::fread(m_input.data(), 1, m_input.size(), m_file);
+        if (got == 0)
+            return false;
+        if (m_compression == Compression::None)
+        {
+            m_reader.feed(m_input.data(), got);
+            return true;
+        }
+#ifdef BULKMT_HAVE_ZLIB
+        m_stream.next_in = reinterpret_cast<Bytef *>(m_input.data());
+        m_stream.avail_in = static_cast<uInt>(got);
+        do
+        {
+            //a log appended to after a restart holds several streams back to back
+            if (m_streamEnded)
+            {
+                inflateReset(&m_stream);
+                m_streamEnded = false;
+            }
+            m_stream.next_out = reinterpret_cast<Bytef *>(m_output.data());
+            m_stream.avail_out = static_cast<uInt>(m_output.size());
+            int status = inflate(&m_stream, Z_NO_FLUSH);
+            m_reader.feed(m_output.data(), m_output.size() - m_stream.avail_out);
+            if (status == Z_STREAM_END)
+                m_streamEnded = true;
+            else if (status != Z_OK && status != Z_BUF_ERROR)
+            {
+                std::cerr << m_path << ": broken deflate stream after record " << m_records << std::endl;
+                m_valid = false;
+            }
+        }
+        while (m_valid && (m_stream.avail_in != 0 || m_stream.avail_out == 0));
+#endif
+        return true;
+    }
+
+    const char *m_path;
+    std::FILE *m_file = nullptr;
+    Compression m_compression = Compression::None;
+    std::uint8_t m_flags = 0;
+    RecordReader m_reader;
+    std::vector<char> m_input;
+    std::uint64_t m_records = 0;
+    std::uint64_t m_commands = 0;
+    bool m_valid = true;
+#ifdef BULKMT_HAVE_ZLIB
+    z_stream m_stream;
+    bool m_inflating = false;
+    bool m_streamEnded = false;
+    std::vector<char> m_output;
+#endif
+};
+
+void print(const Bulk &commands, std::uint64_t micros, const DecodeOptions &options, std::string &text)
+{
+    text.clear();
+    if (options.time)
+        text.append(std::to_string(micros)).push_back(' ');
+    appendBulkText(text, commands);
+    std::fwrite(text.data(), 1, text.size(), stdout);
+}
+
+bool decode(const char *path, const DecodeOptions &options)
+{
+    LogSource source(path);
+    if (!source.open())
+        return false;
+
+    Bulk commands;
+    std::uint64_t micros;
+    std::string text;
+    while (source.next(commands, micros))
+    {
+        if (!options.check)
+            print(commands, micros, options, text);
+    }
+    source.report();
+    if (options.check)
+        std::cout << path << " " << source.records() << " records " << source.commands() << " commands" << std::endl;
+    return source.valid();
+}
+
+//k-way merge by bulk sequence, every file is in sequence order already, so one record per file is held
+//the logs have to come from one run without work stealing: sequences start over with every run
+//and a thief writes the bulks it takes into its own file
+bool merge(const std::vector<const char *> &paths, const DecodeOptions &options)
+{
+    struct Head
+    {
+        LogSource *source;
+        std::shared_ptr<Bulk> commands;
+        std::uint64_t micros;
+    };
+    auto later = [](const Head &a, const Head &b) { return a.commands->sequence() > b.commands->sequence(); };
+    std::priority_queue<Head, std::vector<Head>, decltype(later)> heads(later);
+
+    std::vector<std::unique_ptr<LogSource> > sources;
+    for (const char *path : paths)
+    {
+        sources.emplace_back(new LogSource(path));
+        if (!sources.back()->open())
+            return false;
+        if (!sources.back()->sequenced())
+        {
+            std::cerr << path << ": written without bulk sequences, it cannot be merged" << std::endl;
+            return false;
+        }
+        Head head{ sources.back().get(), std::make_shared<Bulk>(), 0 };
+        if (head.source->next(*head.commands, head.micros))
+            heads.push(head);
+    }
+
+    std::uint64_t records = 0;
+    std::uint64_t commands = 0;
+    std::uint64_t last = 0;
+    bool ordered = true;
+    std::string text;
+    while (!heads.empty())
+    {
+        Head head = heads.top();
+        heads.pop();
+        ordered = ordered && head.commands->sequence() > last;
+        last = head.commands->sequence();
+        ++records;
+        commands += head.commands->size();
+        if (!options.check)
+            print(*head.commands, head.micros, options, text);
+        if (head.source->next(*head.commands, head.micros))
+            heads.push(head);
+    }
+
+    bool valid = true;
+    for (const auto &source : sources)
+    {
+        source->report();
+        valid = source->valid() && valid;
+    }
+    if (!ordered)
+        std::cerr << "sequences out of order, the logs are not from one run or a worker stole bulks" << std::endl;
+    if (options.check)
+        std::cout << "merged " << records << " records " << commands << " commands" << std::endl;
+    return valid && ordered;
+}
+
+//$ bulkmt_decode bulk1791998862_w0_0.bin
+//$ bulkmt_decode --check *.bin
+//$ bulkmt_decode --merge bulk1791998862_w*.bin
+int main(int argc, const char *argv[])
+{
+    DecodeOptions options;
+    std::vector<const char *> paths;
+    bool known = true;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--time")
+            options.time = true;
+        else if (arg == "--check")
+            options.check = true;
+        else if (arg == "--merge")
+            options.merge = true;
+        else if (arg.compare(0, 2, "--") != 0)
+            paths.push_back(argv[i]);
+        else
+            known = false;
+    }
+    if (!known || paths.empty())
+    {
+        std::cerr << "usage: " << argv[0] << " [--time] [--check] [--merge] FILE..." << std::endl;
+        return 1;
+    }
+
+    if (options.merge)
+        return merge(paths, options) ? 0 : 1;
+
+    bool valid = true;
+    for (const char *path : paths)
+        valid = decode(path, options) && valid;
+    return valid ? 0 : 1;
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "affinity.h"
+
+//something the executor runs, a Worker constructed with an Executor is one
+class ExecutorTask
+{
+public:
+    virtual ~ExecutorTask() { }
+    virtual void run() = 0;
+    //called every timer interval with the executor lock held, true queues the task to run
+    virtual bool tick() = 0;
+};
+
+//fixed pool of threads shared by every sink instead of a thread per worker
+//a worker on the executor is a lane: it runs on one pool thread at a time, so its items keep their order,
+//while different lanes run in parallel - ScreenWriter has a single ordered lane, FileWriter one lane per
+//output, and its bulks spread over them unordered
+//lanes only get a thread while they have work, sleeping sinks cost nothing but their queue
+class Executor
+{
+    struct Timer
+    {
+        ExecutorTask *task;
+        std::chrono::milliseconds interval;
+        std::chrono::steady_clock::time_point due;
+    };
+
+public:
+    //0 threads uses every hardware thread, a cpu set pins thread i to its i-th cpu
+    explicit Executor(std::size_t threads = 0, const CpuSet &cpus = CpuSet())
+        : m_cpus(cpus)
+    {
+        std::size_t count = threads ? threads : std::max(std::thread::hardware_concurrency(), 1u);
+        for (std::size_t i = 0; i < count; ++i)
+            m_threads.emplace_back(&Executor::loop, this, i);
+    }
+
+    ~Executor()
+    {
+        stop();
+    }
+
+    Executor(const Executor &) = delete;
+    Executor &operator=(const Executor &) = delete;
+
+    void post(ExecutorTask *task)
+    {
+        {
+            std::lock_guard<std::mutex> lk(m_mutex);
+            m_tasks.push_back(task);
+        }
+        m_condition.notify_one();
+    }
+
+    //task->tick() is asked about every interval until removeTimer, ticks run under the lock removeTimer takes
+    void addTimer(ExecutorTask *task, std::chrono::milliseconds interval)
+    {
+        {
+            std::lock_guard<std::mutex> lk(m_mutex);
+            m_timers.push_back(Timer{ task, interval, std::chrono::steady_clock::now() + interval });
+        }
+        m_condition.notify_all(); //a sleeping thread may need an earlier wake up now
+    }
+
+    void removeTimer(ExecutorTask *task)
+    {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        m_timers.erase(std::remove_if(m_timers.begin(), m_timers.end(), [&](const Timer &timer) { return timer.task == task; }),
+                       m_timers.end());
+    }
+
+    std::size_t threadCount() const { return m_threads.size(); }
+
+    //runs what is queued and joins the threads, the lanes are stopped before it
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lk(m_mutex);
+            m_stopping = true;
+        }
+        m_condition.notify_all();
+        for (auto &thread : m_threads)
+        {
+            if (thread.joinable())
+                thread.join();
+        }
+    }
+
+private:
+    void loop(std::size_t index)
+    {
+        if (!m_cpus.empty() && !m_cpus.pinOne(index))
+            std::cerr << "cannot pin executor thread " << index << " to cpu " << m_cpus.cpus()[index % m_cpus.size()] << std::endl;
+
+        std::unique_lock<std::mutex> lk(m_mutex);
+        for (;;)
+        {
+            if (!m_tasks.empty())
+            {
+                ExecutorTask *task = m_tasks.front();
+                m_tasks.pop_front();
+                lk.unlock();
+                task->run();
+                lk.lock();
+                continue;
+            }
+            if (m_stopping)
+                return;
+            if (m_timers.empty())
+            {
+                m_condition.wait(lk);
+                continue;
+            }
+
+            auto now = std::chrono::steady_clock::now();
+            auto next = m_timers.front().due;
+            for (const Timer &timer : m_timers)
+                next = std::min(next, timer.due);
+            if (next > now)
+            {
+                m_condition.wait_until(lk, next);
+                continue;
+            }
+
+            for (Timer &timer : m_timers)
+            {
+                if (timer.due > now)
+                    continue;
+                timer.due = now + timer.interval;
+                if (timer.task->tick())
+                    m_tasks.push_back(timer.task);
+            }
+            if (m_tasks.size() > 1)
+                m_condition.notify_all();
+        }
+    }
+
+    CpuSet m_cpus;
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::deque<ExecutorTask *> m_tasks;
+    std::vector<Timer> m_timers;
+    std::vector<std::thread> m_threads;
+    bool m_stopping = false;
+};
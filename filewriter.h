@@ -0,0 +1,872 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "binarylog.h"
+#include "handler.h"
+#include "iopipe.h"
+#include "uring.h"
+
+//append-only file on a raw descriptor with its own buffer, the caller decides when bytes reach the kernel
+//with a ring or a pipe attached the buffer is one of its slots and a flush queues an asynchronous write instead
+class LogFile
+{
+public:
+    explicit LogFile(std::size_t bufferSize = 64 * 1024) : m_fd(-1), m_bufferSize(bufferSize), m_size(0) { }
+
+    ~LogFile()
+    {
+        close();
+    }
+
+    LogFile(const LogFile &) = delete;
+    LogFile &operator=(const LogFile &) = delete;
+
+    //the ring must outlive the file, its slots replace the own buffer
+    void attach(AsyncIo *ring)
+    {
+        m_ring = ring;
+    }
+
+    bool open(const std::string &path, bool truncate = false)
+    {
+        close();
+        //ring writes carry their offsets, O_APPEND would ignore them
+        int append = m_ring ? 0 : O_APPEND;
+        m_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : append), 0644);
+        if (m_fd < 0)
+            return false;
+
+        off_t existing = ::lseek(m_fd, 0, SEEK_END);
+        m_size = existing > 0 ? existing : 0;
+        m_path = path;
+        if (!m_ring)
+            m_buffer.reserve(m_bufferSize);
+        return true;
+    }
+
+    void append(const char *data, std::size_t size)
+    {
+        if (m_ring)
+        {
+            appendSlots(data, size);
+            return;
+        }
+        if (m_buffer.size() + size > m_bufferSize)
+            flush();
+        if (size >= m_bufferSize)
+            writeAll(data, size);
+        else
+            m_buffer.append(data, size);
+        m_size += size;
+    }
+
+    void append(const std::string &data)
+    {
+        append(data.data(), data.size());
+    }
+
+    bool flush()
+    {
+        if (m_ring)
+        {
+            if (m_slotUsed != 0)
+            {
+                m_ring->write(m_fd, m_slot, m_slotUsed, m_size - m_slotUsed);
+                m_slotUsed = 0;
+                m_slot = NoSlot;
+            }
+            return true;
+        }
+        bool written = writeAll(m_buffer.data(), m_buffer.size());
+        m_buffer.clear();
+        return written;
+    }
+
+    void close()
+    {
+        if (m_fd < 0)
+            return;
+        flush();
+        if (m_ring)
+        {
+            if (m_slot != NoSlot)
+                m_ring->release(m_slot);
+            m_slot = NoSlot;
+            m_ring->closeWhenDone(m_fd);
+        }
+        else
+            ::close(m_fd);
+        m_fd = -1;
+    }
+
+    bool is_open() const { return m_fd >= 0; }
+    int fd() const { return m_fd; }
+    std::uint64_t size() const { return m_size; } //including bytes still in the buffer
+    const std::string &path() const { return m_path; }
+
+private:
+    static const unsigned NoSlot = ~0u;
+
+    void appendSlots(const char *data, std::size_t size)
+    {
+        while (size > 0)
+        {
+            if (m_slot == NoSlot)
+                m_slot = m_ring->acquire();
+            std::size_t part = std::min(size, m_ring->slotSize() - m_slotUsed);
+            std::memcpy(m_ring->slot(m_slot) + m_slotUsed, data, part);
+            m_slotUsed += part;
+            m_size += part;
+            data += part;
+            size -= part;
+            if (m_slotUsed == m_ring->slotSize())
+                flush();
+        }
+    }
+
+    bool writeAll(const char *data, std::size_t size)
+    {
+        while (size > 0)
+        {
+            ssize_t written = ::write(m_fd, data, size);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            data += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    int m_fd;
+    std::size_t m_bufferSize;
+    std::uint64_t m_size;
+    std::string m_path;
+    std::string m_buffer;
+    AsyncIo *m_ring = nullptr;
+    unsigned m_slot = NoSlot;
+    std::size_t m_slotUsed = 0;
+};
+
+enum class LogFormat
+{
+    Text = 0,  //"bulk: a b c" lines in .log files
+    Binary = 1 //framed records with crc in .bin files (binarylog.h), read back with bulkmt_decode
+};
+
+//how FileWriter workers hand bytes to the kernel
+enum class IoBackend
+{
+    Threads = 0, //blocking write(2) on every worker thread
+    Uring = 1,   //each worker submits its writes in batches through its own io_uring, threads when unavailable
+    Pipe = 2     //each worker only formats, its own I/O thread writes the filled buffers with pwritev
+};
+
+//when FileWriter makes written bulks durable with fdatasync
+enum class Durability
+{
+    None = 0,       //left to the kernel
+    PerBulk = 1,    //before the next bulk is written, with a ring or a pipe the worker waits for the sync to complete
+    Group = 2,      //once per worker batch, when syncBulks bulks or syncInterval have accumulated
+    PerRotation = 3 //when a file is rotated or closed, every file of the per-bulk layout is its own rotation
+};
+
+enum class OutputMode
+{
+    PerBulk = 0, //one bulk<time>_<n>.log per block, the historical layout
+    Append = 1   //one open file per worker, rotated by size or age
+};
+
+struct FileOutputOptions
+{
+    OutputMode mode = OutputMode::PerBulk;
+    std::uint64_t rotateBytes = 0; //0 never rotates by size
+    std::chrono::seconds rotateInterval{0}; //0 never rotates by age
+    bool index = false; //write "<offset> <length>" of every block to a .idx file next to the log
+    std::size_t bufferSize = 64 * 1024;
+    std::string directory; //empty means the working directory at FileWriter construction
+    bool echoPaths = true; //print every file name on stdout when it is opened
+    LogFormat format = LogFormat::Text;
+    Compression compression = Compression::None; //binary format only, one stream per file
+    IoBackend backend = IoBackend::Threads;
+    std::size_t ringSlots = 64; //bufferSize sized buffers in flight per worker with IoBackend::Uring or Pipe
+    Durability durability = Durability::None;
+    std::size_t syncBulks = 0;                 //group commit after this many bulks
+    std::chrono::milliseconds syncInterval{0}; //group commit once the oldest unsynced bulk is this old
+                                               //with both 0 every batch ends with a commit
+    CpuSet cpus; //worker i runs on the i-th cpu of the set only, empty leaves placement to the scheduler
+    bool sequenceNames = false; //per-bulk files are named by the bulk sequence padded to 20 digits, so names sort
+                                //in parse order whichever worker wrote them; bulks without one keep the counter
+};
+
+//output state of one FileWriter worker, touched only from that worker's thread
+//names only need the shared atomic counter, so workers never wait for each other
+class FileOutput
+{
+public:
+    FileOutput(const FileOutputOptions &options, std::size_t workerIndex, std::time_t startedAt, std::atomic<std::uint64_t> &fileCounter)
+        : m_options(options)
+        , m_workerIndex(workerIndex)
+        , m_startedAt(std::to_string(startedAt))
+        , m_fileCounter(fileCounter)
+        , m_log(options.bufferSize)
+        , m_index(4096)
+        , m_part(0)
+        , m_openedAt(0)
+        , m_directory(-1)
+        , m_directoryDirty(false)
+        , m_unsynced(0)
+        , m_plainBytes(0)
+    {
+        if (options.format == LogFormat::Binary && options.compression == Compression::Deflate)
+            m_deflater.reset(new LogDeflater());
+
+        if (options.backend == IoBackend::Pipe)
+        {
+            IoPipe *pipe = new IoPipe();
+            m_ring.reset(pipe);
+            pipe->open(options.ringSlots, options.bufferSize);
+        }
+        else if (options.backend == IoBackend::Uring)
+        {
+            IoRing *ring = new IoRing();
+            m_ring.reset(ring);
+            if (!ring->open(static_cast<unsigned>(options.ringSlots), options.ringSlots, options.bufferSize))
+            {
+                static std::atomic<bool> warned{false};
+                if (!warned.exchange(true))
+                    std::cerr << "io_uring is not available (" << std::strerror(errno) << "), writing from worker threads" << std::endl;
+                m_ring.reset();
+                return;
+            }
+        }
+        else
+            return;
+        m_log.attach(m_ring.get());
+        m_index.attach(m_ring.get());
+    }
+
+    ~FileOutput()
+    {
+        close();
+    }
+
+    //the worker hooks are needed for batched submission and group commits only
+    bool batched() const { return m_ring || m_deflater || m_options.durability == Durability::Group; }
+
+    //how often an idle worker calls batchDone, it reaps ring completions and runs overdue group commits
+    std::chrono::milliseconds idleInterval() const
+    {
+        std::chrono::milliseconds interval = m_options.syncInterval;
+        if (m_ring && (interval.count() == 0 || interval > std::chrono::milliseconds(10)))
+            interval = std::chrono::milliseconds(10);
+        return interval;
+    }
+
+    //the worker batch is over: its records become decodable, a due group commit covers all of its bulks
+    //and queued writes go to the kernel in one call
+    void batchDone()
+    {
+        AllocScope scope(AllocSite::File);
+        flushStream();
+        if (m_options.durability == Durability::Group && m_unsynced != 0 && commitDue())
+            commit();
+        if (m_ring)
+            m_ring->submit();
+    }
+
+    void write(const Bulk &commands)
+    {
+        if (m_options.mode == OutputMode::PerBulk)
+        {
+            m_path.assign(m_options.directory).append("/bulk").append(m_startedAt).append("_");
+            if (m_options.sequenceNames && commands.sequence() != 0)
+            {
+                char sequence[24];
+                std::snprintf(sequence, sizeof(sequence), "%020llu", static_cast<unsigned long long>(commands.sequence()));
+                m_path.append(sequence);
+            }
+            else
+                m_path.append(std::to_string(m_fileCounter.fetch_add(1, std::memory_order_relaxed)));
+            m_path.append(extension());
+            echo(m_path);
+            openLog(m_path, true);
+            format(commands);
+            appendLog(m_text);
+            endStream();
+            if (m_options.durability == Durability::PerBulk || m_options.durability == Durability::PerRotation)
+            {
+                m_log.flush();
+                sync(m_log.fd());
+                sync(directory());
+                if (m_options.durability == Durability::PerBulk)
+                    awaitSyncs();
+            }
+            else
+                unsynced();
+            m_log.close();
+            return;
+        }
+
+        //the clock is only read when age based rotation is configured
+        std::time_t now = m_options.rotateInterval.count() != 0 ? std::time(nullptr) : m_openedAt;
+        if (!m_log.is_open() || needsRotation(now))
+            rotate(std::time(nullptr));
+
+        format(commands);
+        if (m_options.index && m_index.is_open())
+            m_index.append(std::to_string(logOffset()) + " " + std::to_string(m_text.size()) + "\n");
+        appendLog(m_text);
+
+        if (m_options.durability == Durability::PerBulk)
+        {
+            commit();
+            awaitSyncs();
+        }
+        else
+            unsynced();
+    }
+
+    void close()
+    {
+        endStream();
+        if (m_options.durability != Durability::None && m_unsynced != 0)
+            commit();
+        m_log.close();
+        m_index.close();
+        if (m_ring)
+            m_ring->drain();
+        if (m_directory >= 0)
+            ::close(m_directory);
+        m_directory = -1;
+    }
+
+private:
+    bool needsRotation(std::time_t now) const
+    {
+        if (m_options.rotateBytes != 0 && m_log.size() >= m_options.rotateBytes)
+            return true;
+        return m_options.rotateInterval.count() != 0 && now - m_openedAt >= m_options.rotateInterval.count();
+    }
+
+    //after the file it goes to is open: opening one forgets the interned commands the previous file defined
+    void format(const Bulk &commands)
+    {
+        m_text.clear();
+        if (m_options.format == LogFormat::Binary)
+            appendBinaryRecord(m_text, commands, &m_defined, true);
+        else
+            appendBulkText(m_text, commands);
+    }
+
+    void rotate(std::time_t now)
+    {
+        endStream();
+        if (m_log.is_open() && m_options.durability != Durability::None && m_unsynced != 0)
+            commit();
+
+        std::string path = m_options.directory + "/bulk" + std::to_string(now) + "_w" + std::to_string(m_workerIndex)
+                         + "_" + std::to_string(m_part++) + extension();
+        openLog(path, false);
+        if (m_options.index)
+            m_index.open(path + ".idx");
+        m_openedAt = now;
+        m_directoryDirty = true;
+        echo(path);
+    }
+
+    const char *extension() const { return m_options.format == LogFormat::Binary ? ".bin" : ".log"; }
+
+    //a binary log starts with its header, appending to an existing one continues after it
+    void openLog(const std::string &path, bool truncate)
+    {
+        m_log.open(path, truncate);
+        m_plainBytes = 0;
+        if (m_options.format == LogFormat::Binary && m_log.size() == 0)
+        {
+            std::string header;
+            appendBinaryLogHeader(header, m_deflater ? Compression::Deflate : Compression::None,
+                                  BinaryLogDictionary | BinaryLogSequence);
+            m_log.append(header);
+        }
+        m_defined.clear(); //every file defines the interned commands it uses
+    }
+
+    void appendLog(const std::string &text)
+    {
+        if (!m_deflater)
+        {
+            m_log.append(text);
+            return;
+        }
+        m_deflater->write(text.data(), text.size(), [this](const char *data, std::size_t size) { m_log.append(data, size); });
+        m_plainBytes += text.size();
+    }
+
+    //index offsets of a compressed log count uncompressed record bytes after the header
+    std::uint64_t logOffset() const { return m_deflater ? m_plainBytes : m_log.size(); }
+
+    void flushStream()
+    {
+        if (m_deflater && m_log.is_open())
+            m_deflater->flush([this](const char *data, std::size_t size) { m_log.append(data, size); });
+    }
+
+    void endStream()
+    {
+        if (m_deflater && m_log.is_open())
+            m_deflater->finish([this](const char *data, std::size_t size) { m_log.append(data, size); });
+    }
+
+    void unsynced()
+    {
+        if (m_unsynced++ == 0)
+            m_unsyncedSince = std::chrono::steady_clock::now();
+    }
+
+    bool commitDue() const
+    {
+        if (m_options.syncBulks == 0 && m_options.syncInterval.count() == 0)
+            return true;
+        if (m_options.syncBulks != 0 && m_unsynced >= m_options.syncBulks)
+            return true;
+        return m_options.syncInterval.count() != 0 && std::chrono::steady_clock::now() - m_unsyncedSince >= m_options.syncInterval;
+    }
+
+    //everything written so far reaches the disk; with a ring the syncs are queued behind the writes
+    void commit()
+    {
+        if (m_options.mode == OutputMode::PerBulk)
+        {
+            //the files are closed already, one syncfs covers all of them and their directory entries
+            if (m_ring)
+                m_ring->drain();
+            ::syncfs(directory());
+        }
+        else
+        {
+            flushStream();
+            m_log.flush();
+            m_index.flush();
+            sync(m_log.fd());
+            sync(m_index.fd());
+            if (m_directoryDirty)
+                sync(directory());
+            m_directoryDirty = false;
+        }
+        m_unsynced = 0;
+    }
+
+    //a ring only queues the fdatasync, the next bulk would be written before it completes
+    void awaitSyncs()
+    {
+        if (m_ring)
+            m_ring->drain();
+    }
+
+    void sync(int fd)
+    {
+        if (fd < 0)
+            return;
+        if (m_ring)
+            m_ring->sync(fd);
+        else
+            ::fdatasync(fd);
+    }
+
+    //opened on first use, new file names become durable with an fsync of their directory
+    int directory()
+    {
+        if (m_directory < 0)
+            m_directory = ::open(m_options.directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        return m_directory;
+    }
+
+    void echo(const std::string &path)
+    {
+        if (m_options.echoPaths)
+            std::cout << std::this_thread::get_id() << " " << path << std::endl;
+    }
+
+    FileOutputOptions m_options;
+    std::size_t m_workerIndex;
+    std::string m_startedAt;
+    std::atomic<std::uint64_t> &m_fileCounter;
+    std::string m_path; //reused per-bulk file name
+    std::unique_ptr<AsyncIo> m_ring; //declared before the files it has to outlive
+    LogFile m_log;
+    LogFile m_index;
+    std::string m_text; //reused formatting buffer
+    std::size_t m_part;
+    std::time_t m_openedAt;
+    int m_directory;
+    bool m_directoryDirty; //a log was created since the last commit
+    std::size_t m_unsynced; //bulks written since the last commit
+    std::chrono::steady_clock::time_point m_unsyncedSince;
+    std::unique_ptr<LogDeflater> m_deflater; //binary logs with Compression::Deflate
+    std::uint64_t m_plainBytes;              //record bytes given to the deflater for the open log
+    std::vector<bool> m_defined;             //dictionary ids defined in the open binary log
+};
+
+//how FileWriter picks the worker for the next bulk
+enum class DispatchPolicy
+{
+    RoundRobin = 0,
+    LeastQueued = 1,  //fewest pending bulks
+    LeastBytes = 2,   //fewest pending command bytes
+    WorkStealing = 3  //round-robin, idle workers take queued bulks from busy peers
+};
+
+//FileWriter grows or shrinks its pool between minWorkers and maxWorkers
+//when the expected wait of a new bulk (average queue depth times average write latency) leaves the target
+struct AutoscaleOptions
+{
+    std::size_t minWorkers = 0;
+    std::size_t maxWorkers = 0; //0 disables autoscaling
+    std::chrono::milliseconds interval{100}; //sampling period
+    std::size_t window = 10; //samples in the sliding window a decision is based on
+    std::chrono::milliseconds targetWait{20};
+
+    bool enabled() const { return maxWorkers != 0; }
+};
+
+//shared by every file writer of the process, writers started within the same second get distinct names
+inline std::atomic<std::uint64_t> &bulkFileCounter()
+{
+    static std::atomic<std::uint64_t> counter{0};
+    return counter;
+}
+
+//Queue picks the worker queue, FileWriter keeps the mutex one
+template<template<typename> class Queue = MutexQueue>
+class BasicFileWriter final : public IBulkHandler
+{
+    using FileWorker = Worker<BulkPtr, Queue>;
+
+    struct Sample
+    {
+        double depth;     //pending bulks per worker
+        double latencyMs; //average write time
+    };
+
+public:
+    BasicFileWriter(int wrkCount, std::size_t capacity = 0, OverflowPolicy policy = OverflowPolicy::Block,
+                    DispatchPolicy dispatch = DispatchPolicy::RoundRobin, const AutoscaleOptions &autoscale = AutoscaleOptions(),
+                    const FileOutputOptions &output = FileOutputOptions(), Executor *executor = nullptr)
+        : m_executor(executor)
+        , m_capacity(capacity)
+        , m_policy(policy)
+        , m_dispatch(dispatch)
+        , m_autoscale(autoscale)
+        , m_output(output)
+        , m_startedAt(std::time(nullptr))
+        , m_fileCounter(bulkFileCounter())
+        , m_roundRobin(0)
+        , m_scaling(false)
+    {
+        if (m_output.directory.empty())
+        {
+            char buff[FILENAME_MAX];
+            if (getcwd(buff, FILENAME_MAX))
+                m_output.directory = buff;
+        }
+
+        std::size_t count = std::max(wrkCount, 1);
+        if (m_autoscale.enabled())
+            count = std::min(std::max(count, std::max<std::size_t>(m_autoscale.minWorkers, 1)), m_autoscale.maxWorkers);
+
+        {
+            std::lock_guard<std::shared_timed_mutex> lk(m_workersMutex); //thieves wait until all peers exist
+            for (std::size_t i = 0; i < count; ++i)
+                m_workers.push_back(makeWorker(i));
+            for (auto &worker : m_workers)
+                worker->start();
+        }
+
+        if (m_autoscale.enabled())
+        {
+            m_scaling = true;
+            m_scaler = std::thread(&BasicFileWriter::scaleLoop, this);
+        }
+    }
+
+    void push_back(const BulkPtr &commands)
+    {
+        //only the autoscaler changes the pool, without it publishing threads only read it
+        std::shared_lock<std::shared_timed_mutex> lk(m_workersMutex, std::defer_lock);
+        if (m_autoscale.enabled())
+            lk.lock();
+
+        FileWorker *worker = m_workers.at(pickWorker()).get();
+        worker->push_back(commands);
+    }
+
+    //the pool is fixed from here on, every worker drains its queue on its own until the deadline
+    void close(std::chrono::steady_clock::time_point deadline)
+    {
+        if (m_scaler.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lk(m_scaleMutex);
+                m_scaling = false;
+            }
+            m_scaleCondition.notify_all();
+            m_scaler.join();
+        }
+
+        for (std::size_t i = 0; i < m_workers.size(); ++i)
+            m_workers.at(i)->close(deadline);
+    }
+
+    void stop()
+    {
+        close(std::chrono::steady_clock::time_point());
+        for (std::size_t i = 0; i < m_workers.size(); ++i)
+            m_workers.at(i)->stop();
+        for (auto &output : m_outputs)
+            output->close();
+    }
+
+    //retired workers drained fully, only the pool can have leftovers; each worker's part stays in order
+    std::vector<BulkPtr> undrained()
+    {
+        std::vector<BulkPtr> undrained;
+        for (auto &worker : m_workers)
+        {
+            std::vector<BulkPtr> left = worker->takeUndrained();
+            undrained.insert(undrained.end(), left.begin(), left.end());
+        }
+        return undrained;
+    }
+
+    std::size_t workerCount()
+    {
+        std::shared_lock<std::shared_timed_mutex> lk(m_workersMutex);
+        return m_workers.size();
+    }
+
+    void write(FileOutput *output, const BulkPtr &commands)
+    {
+        AllocScope scope(AllocSite::File);
+        auto started = std::chrono::steady_clock::now();
+        output->write(*commands);
+
+        auto elapsed = std::chrono::steady_clock::now() - started;
+        m_writeNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+        m_writeCount++;
+    }
+
+private:
+    //the worker is registered but not started, it starts once it has its place in the pool
+    WorkerHandle<BulkPtr, Queue> makeWorker(std::size_t index)
+    {
+        WorkerHooks<BulkPtr> hooks;
+        if (m_dispatch == DispatchPolicy::WorkStealing && !m_executor)
+            hooks.steal = std::bind(&BasicFileWriter::steal, this, index, std::placeholders::_1);
+
+        m_outputs.push_back(std::unique_ptr<FileOutput>(new FileOutput(m_output, index, m_startedAt, m_fileCounter)));
+        FileOutput *output = m_outputs.back().get();
+        if (!m_output.cpus.empty())
+        {
+            CpuSet cpus = m_output.cpus;
+            hooks.started = [cpus, index]
+            {
+                if (!cpus.pinOne(index))
+                    std::cerr << "cannot pin file worker " << index << " to cpu " << cpus.cpus()[index % cpus.size()] << std::endl;
+            };
+        }
+        if (output->batched())
+        {
+            hooks.batchDone = std::bind(&FileOutput::batchDone, output);
+            hooks.idle = hooks.batchDone;
+            hooks.idleInterval = output->idleInterval();
+        }
+        WorkerHandle<BulkPtr, Queue> worker(new FileWorker(
+            std::bind(&BasicFileWriter::write, this, output, std::placeholders::_1), m_capacity, m_policy, hooks, false, m_executor));
+        registerWorker(worker.get());
+        return worker;
+    }
+
+    void scaleLoop()
+    {
+        std::deque<Sample> window;
+        std::uint64_t lastNanos = 0;
+        std::uint64_t lastCount = 0;
+
+        std::unique_lock<std::mutex> lk(m_scaleMutex);
+        while (!m_scaleCondition.wait_for(lk, m_autoscale.interval, [this] { return !m_scaling; }))
+        {
+            std::uint64_t nanos = m_writeNanos.load(std::memory_order_relaxed);
+            std::uint64_t count = m_writeCount.load(std::memory_order_relaxed);
+
+            Sample sample;
+            {
+                std::shared_lock<std::shared_timed_mutex> workersLock(m_workersMutex);
+                std::size_t pending = 0;
+                for (auto &worker : m_workers)
+                    pending += worker->pending();
+                sample.depth = static_cast<double>(pending) / m_workers.size();
+            }
+            sample.latencyMs = count == lastCount ? 0.0 : (nanos - lastNanos) / 1e6 / (count - lastCount);
+            lastNanos = nanos;
+            lastCount = count;
+
+            window.push_back(sample);
+            if (window.size() > m_autoscale.window)
+                window.pop_front();
+            if (window.size() < m_autoscale.window)
+                continue;
+
+            double depth = 0, latencyMs = 0;
+            for (const Sample &s : window)
+            {
+                depth += s.depth;
+                latencyMs += s.latencyMs;
+            }
+            depth /= window.size();
+            latencyMs /= window.size();
+
+            double expectedWaitMs = depth * latencyMs;
+            double targetMs = static_cast<double>(m_autoscale.targetWait.count());
+            bool resized = false;
+            if (expectedWaitMs > targetMs && depth > 1.0)
+                resized = grow();
+            else if (expectedWaitMs < targetMs / 4 && depth < 1.0)
+                resized = shrink();
+
+            if (resized)
+                window.clear(); //let the new pool size settle before deciding again
+        }
+    }
+
+    //retired workers are reused first, they keep their pool index and their stats
+    bool grow()
+    {
+        std::lock_guard<std::shared_timed_mutex> lk(m_workersMutex);
+        if (m_workers.size() >= m_autoscale.maxWorkers)
+            return false;
+
+        if (!m_retired.empty())
+        {
+            m_retired.back()->start();
+            m_workers.push_back(std::move(m_retired.back()));
+            m_retired.pop_back();
+        }
+        else
+        {
+            m_workers.push_back(makeWorker(m_workers.size()));
+            m_workers.back()->start();
+        }
+        return true;
+    }
+
+    bool shrink()
+    {
+        WorkerHandle<BulkPtr, Queue> retired;
+        {
+            std::lock_guard<std::shared_timed_mutex> lk(m_workersMutex);
+            if (m_workers.size() <= std::max<std::size_t>(m_autoscale.minWorkers, 1))
+                return false;
+
+            retired = std::move(m_workers.back());
+            m_workers.pop_back();
+        }
+
+        retired->stop(); //no new bulks reach it now, it drains its queue and exits
+
+        std::lock_guard<std::shared_timed_mutex> lk(m_workersMutex);
+        m_outputs.at(m_workers.size())->close(); //the retired index is the first free one, reopened with a new name on restart
+        m_retired.push_back(std::move(retired));
+        return true;
+    }
+
+    std::size_t pickWorker()
+    {
+        //ties are broken by the round-robin position, so idle workers still take turns
+        std::size_t start = m_roundRobin.fetch_add(1, std::memory_order_relaxed) % m_workers.size();
+        if (m_dispatch == DispatchPolicy::RoundRobin || m_dispatch == DispatchPolicy::WorkStealing)
+            return start;
+
+        std::size_t best = start;
+        std::size_t bestLoad = load(*m_workers[best]);
+        for (std::size_t k = 1; k < m_workers.size(); ++k)
+        {
+            std::size_t index = (start + k) % m_workers.size();
+            std::size_t current = load(*m_workers[index]);
+            if (current < bestLoad)
+            {
+                best = index;
+                bestLoad = current;
+            }
+        }
+        return best;
+    }
+
+    std::size_t load(FileWorker &worker)
+    {
+        return m_dispatch == DispatchPolicy::LeastBytes ? worker.pendingBytes() : worker.pending();
+    }
+
+    //called on an idle worker thread, takes the oldest bulk of the most loaded peer
+    bool steal(std::size_t thief, BulkPtr &commands)
+    {
+        std::shared_lock<std::shared_timed_mutex> lk(m_workersMutex);
+        FileWorker *victim = nullptr;
+        std::size_t victimLoad = 1; //the only pending bulk of a peer is already being written
+        for (std::size_t i = 0; i < m_workers.size(); ++i)
+        {
+            std::size_t current = m_workers[i]->pending();
+            if (i != thief && current > victimLoad)
+            {
+                victim = m_workers[i].get();
+                victimLoad = current;
+            }
+        }
+        return victim && victim->steal(commands);
+    }
+
+    std::vector<WorkerHandle<BulkPtr, Queue> > m_workers;
+    std::vector<WorkerHandle<BulkPtr, Queue> > m_retired; //stopped by shrink, kept for their stats
+    std::vector<std::unique_ptr<FileOutput> > m_outputs; //one per pool index, outlives the worker using it
+    std::shared_timed_mutex m_workersMutex;
+    Executor *m_executor; //workers are lanes of it when set, one per output
+    std::size_t m_capacity;
+    OverflowPolicy m_policy;
+    DispatchPolicy m_dispatch;
+    AutoscaleOptions m_autoscale;
+    FileOutputOptions m_output;
+    std::time_t m_startedAt; //per-bulk names use the start time and a counter instead of a clock read per bulk
+    std::atomic<std::uint64_t> &m_fileCounter;
+    std::atomic<std::size_t> m_roundRobin; //atomic for sinks shared by several publishing threads, see libbulk
+
+    std::atomic<std::uint64_t> m_writeNanos{0};
+    std::atomic<std::uint64_t> m_writeCount{0};
+    std::thread m_scaler;
+    std::mutex m_scaleMutex;
+    std::condition_variable m_scaleCondition;
+    bool m_scaling;
+};
+
+using FileWriter = BasicFileWriter<>;
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <chrono>
+#include <initializer_list>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+#include "allocstats.h"
+#include "worker.h"
+
+//sink API: a parser hands every finished bulk to push_back, on its own thread and in input order
+// - the bulk is shared read-only with the other sinks, keep the BulkPtr to use it after push_back returns
+// - push_back runs on the parser's hot path, hand the bulk to a Worker instead of doing I/O in it
+// - stop drains what was accepted and joins the sink's threads, push_back is not called after it
+// - close(deadline) starts that stop without waiting, so several sinks drain at once; whatever is not written
+//   by the deadline is handed back by undrained() after stop instead, see stopAll
+// - registerWorker is optional, registered workers show up in printStats and in workers()
+//subscribe(IBulkHandler&) costs one virtual call per bulk, BasicParser<Sinks...> calls push_back directly
+//and needs no base class at all - a final sink type lets the compiler inline it
+class IBulkHandler
+{
+public:
+    virtual ~IBulkHandler() = default;
+
+    virtual void push_back(const BulkPtr &commands) = 0;
+    virtual void stop() = 0;
+
+    //a sink without its own queue has nothing to drain early, stop does all of it
+    virtual void close(std::chrono::steady_clock::time_point deadline) { (void)deadline; }
+    virtual std::vector<BulkPtr> undrained() { return std::vector<BulkPtr>(); }
+
+    //every worker the handler ever ran, safe to call from any thread while the handler exists
+    //the counters behind IWorker::stats() are live, workers retired by autoscaling stay in the list
+    std::vector<IWorker *> workers() const
+    {
+        std::lock_guard<std::mutex> lk(m_workersMutex);
+        return m_statsWorkers;
+    }
+
+    void printStats(bool detailed = false)
+    {
+        std::vector<IWorker *> all = workers();
+
+        std::cout << "Blocks" << std::endl;
+        for (IWorker *worker : all)
+            std::cout << "  " << worker->getThreadId() << " => " << worker->stats().acceptedBlocks() << std::endl;
+
+        std::cout << "Commands" << std::endl;
+        for (IWorker *worker : all)
+            std::cout << "  " << worker->getThreadId() << " => " << worker->stats().acceptedCommands() << std::endl;
+
+        bool bounded = false;
+        for (IWorker *worker : all)
+        {
+            if (worker->capacity() == 0)
+                continue;
+            if (!bounded)
+                std::cout << "Overflow" << std::endl;
+            bounded = true;
+            std::cout << "  " << worker->getThreadId() << " => " << overflowPolicyName(worker->overflowPolicy())
+                      << " " << worker->overflowCount() << " (capacity " << worker->capacity() << ")" << std::endl;
+        }
+
+        bool stealing = false;
+        for (IWorker *worker : all)
+            stealing = stealing || worker->stolenCount() != 0;
+        if (stealing)
+        {
+            std::cout << "Stolen" << std::endl;
+            for (IWorker *worker : all)
+                std::cout << "  " << worker->getThreadId() << " => " << worker->stolenCount() << std::endl;
+        }
+
+        if (!detailed)
+            return;
+
+        std::cout << "Cores" << std::endl;
+        for (IWorker *worker : all)
+            std::cout << "  " << worker->getThreadId() << " => " << worker->cpu() << std::endl;
+
+        std::cout << "Written" << std::endl;
+        for (IWorker *worker : all)
+        {
+            const WorkerStats &stats = worker->stats();
+            std::cout << "  " << worker->getThreadId() << " => " << stats.writtenBlocks() << " blocks, "
+                      << stats.writtenCommands() << " commands, " << stats.writtenBytes() << " bytes, queue high-water "
+                      << stats.highWater() << ", latency p50 " << stats.latencyPercentile(0.5).count() << "us p99 "
+                      << stats.latencyPercentile(0.99).count() << "us max " << stats.latencyPercentile(1.0).count() << "us"
+                      << std::endl;
+        }
+    }
+
+protected:
+    //the worker must outlive the handler's use of it, both writers keep theirs until destruction
+    void registerWorker(IWorker *worker)
+    {
+        std::lock_guard<std::mutex> lk(m_workersMutex);
+        m_statsWorkers.push_back(worker);
+    }
+
+private:
+    mutable std::mutex m_workersMutex;
+    std::vector<IWorker *> m_statsWorkers;
+};
+
+//stops the sinks in parallel, shutdown takes as long as the slowest of them or until the deadline
+//a default deadline drains everything
+inline void stopAll(std::initializer_list<IBulkHandler *> sinks,
+                    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point())
+{
+    for (IBulkHandler *sink : sinks)
+        sink->close(deadline);
+    for (IBulkHandler *sink : sinks)
+        sink->stop();
+}
@@ -0,0 +1,210 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <limits.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "asyncio.h"
+#include "worker.h"
+
+//I/O stage on its own thread: the owner formats into slots and queues them, the thread only writes
+//the two sides meet in lock-free rings, one of queued operations and one of slots coming back
+//everything queued runs in order, consecutive writes to one file at adjacent offsets go out as one pwritev
+class IoPipe : public AsyncIo
+{
+    enum class Kind : std::uint8_t
+    {
+        Write,
+        Sync,
+        Close
+    };
+
+    struct Operation
+    {
+        Kind kind;
+        int fd;
+        unsigned slot;
+        std::size_t size;
+        std::uint64_t offset;
+    };
+
+public:
+    static const std::uint64_t CurrentOffset = ~0ull; //writev at the file position, for pipes and terminals
+
+    IoPipe() = default;
+
+    IoPipe(const IoPipe &) = delete;
+    IoPipe &operator=(const IoPipe &) = delete;
+
+    ~IoPipe()
+    {
+        if (!m_thread.joinable())
+            return;
+        drain();
+        m_operations->close();
+        m_thread.join();
+    }
+
+    bool open(std::size_t slotCount, std::size_t slotSize)
+    {
+        slotCount = std::max<std::size_t>(slotCount, 1);
+        m_slotSize = slotSize;
+        m_arena.reset(new char[slotCount * slotSize]);
+        for (std::size_t i = 0; i < slotCount; ++i)
+            m_free.push_back(static_cast<unsigned>(slotCount - 1 - i));
+        //every slot in flight plus a sync and a close for each of them fit without waiting
+        m_operations.reset(new SpscQueue<Operation>(slotCount * 4));
+        m_returned.reset(new SpscQueue<unsigned>(slotCount));
+        m_thread = std::thread(&IoPipe::loop, this);
+        return true;
+    }
+
+    std::size_t slotSize() const { return m_slotSize; }
+    char *slot(unsigned index) { return m_arena.get() + index * m_slotSize; }
+    std::uint64_t errorCount() const { return m_errors.load(std::memory_order_relaxed); }
+
+    unsigned acquire()
+    {
+        while (m_free.empty())
+            m_returned->pop_all_for(m_free, std::chrono::milliseconds(100));
+        unsigned index = m_free.back();
+        m_free.pop_back();
+        return index;
+    }
+
+    void release(unsigned index)
+    {
+        m_free.push_back(index);
+    }
+
+    void write(int fd, unsigned index, std::size_t size, std::uint64_t offset)
+    {
+        queue(Operation{ Kind::Write, fd, index, size, offset });
+    }
+
+    void sync(int fd)
+    {
+        queue(Operation{ Kind::Sync, fd, 0, 0, 0 });
+    }
+
+    void closeWhenDone(int fd)
+    {
+        queue(Operation{ Kind::Close, fd, 0, 0, 0 });
+    }
+
+    //the I/O thread wakes as soon as something is queued, there is nothing to hand over
+    void submit() { }
+
+    void drain()
+    {
+        std::unique_lock<std::mutex> lk(m_doneMutex);
+        m_doneCondition.wait(lk, [&] { return m_completed.load(std::memory_order_acquire) == m_queued; });
+    }
+
+private:
+    void queue(Operation &&operation)
+    {
+        ++m_queued;
+        m_operations->push(std::move(operation));
+    }
+
+    void loop()
+    {
+        std::vector<Operation> batch;
+        std::vector<iovec> vectors;
+        while (m_operations->pop_all(batch))
+        {
+            for (std::size_t i = 0; i < batch.size();)
+            {
+                const Operation &operation = batch[i];
+                if (operation.kind == Kind::Sync)
+                    m_errors += ::fdatasync(operation.fd) != 0;
+                else if (operation.kind == Kind::Close)
+                    ::close(operation.fd);
+                if (operation.kind != Kind::Write)
+                {
+                    ++i;
+                    continue;
+                }
+
+                //the run of writes that continue each other
+                std::size_t end = i + 1;
+                std::uint64_t next = operation.offset + operation.size;
+                while (end < batch.size() && end - i < IOV_MAX && batch[end].kind == Kind::Write && batch[end].fd == operation.fd
+                       && (operation.offset == CurrentOffset ? batch[end].offset == CurrentOffset : batch[end].offset == next))
+                    next += batch[end++].size;
+
+                vectors.clear();
+                for (std::size_t k = i; k < end; ++k)
+                    vectors.push_back(iovec{ slot(batch[k].slot), batch[k].size });
+                m_errors += !writeAll(operation.fd, vectors, operation.offset);
+                for (std::size_t k = i; k < end; ++k)
+                    m_returned->push(std::move(batch[k].slot));
+                i = end;
+            }
+
+            m_completed.fetch_add(batch.size(), std::memory_order_release);
+            batch.clear();
+            std::lock_guard<std::mutex> lk(m_doneMutex);
+            m_doneCondition.notify_all();
+        }
+    }
+
+    static bool writeAll(int fd, std::vector<iovec> &vectors, std::uint64_t offset)
+    {
+        iovec *vector = vectors.data();
+        int count = static_cast<int>(vectors.size());
+        while (count > 0)
+        {
+            ssize_t written = offset == CurrentOffset ? ::writev(fd, vector, count)
+                                                      : ::pwritev(fd, vector, count, static_cast<off_t>(offset));
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            if (written == 0)
+                return false;
+            if (offset != CurrentOffset)
+                offset += written;
+
+            //a short write leaves the rest of the vectors for the next call
+            std::size_t done = static_cast<std::size_t>(written);
+            while (count > 0 && done >= vector->iov_len)
+            {
+                done -= vector->iov_len;
+                ++vector;
+                --count;
+            }
+            if (count > 0)
+            {
+                vector->iov_base = static_cast<char *>(vector->iov_base) + done;
+                vector->iov_len -= done;
+            }
+        }
+        return true;
+    }
+
+    std::unique_ptr<char[]> m_arena;
+    std::size_t m_slotSize = 0;
+    std::vector<unsigned> m_free;                       //owner thread only
+    std::uint64_t m_queued = 0;                         //owner thread only
+    std::unique_ptr<SpscQueue<Operation> > m_operations;
+    std::unique_ptr<SpscQueue<unsigned> > m_returned;
+    std::atomic<std::uint64_t> m_completed{0};
+    std::atomic<std::uint64_t> m_errors{0};
+    std::mutex m_doneMutex;
+    std::condition_variable m_doneCondition;
+    std::thread m_thread;
+};
@@ -0,0 +1,121 @@
+#include <climits>
+#include <memory>
+#include <mutex>
+#include <tuple>
+
+#include "libbulk.h"
+#include "parser.h"
+#include "screenwriter.h"
+#include "filewriter.h"
+
+namespace
+{
+
+//sinks shared by every open handle
+struct Sinks
+{
+    Sinks() : file(2) { }
+
+    ~Sinks()
+    {
+        screen.stop();
+        file.stop();
+    }
+
+    //handles publish from any number of threads at once, both writers take several producers
+    void push_back(const BulkPtr &commands)
+    {
+        screen.push_back(commands);
+        file.push_back(commands);
+    }
+
+    BasicScreenWriter<MpscQueue> screen;
+    FileWriter file;
+};
+
+std::mutex sinksMutex;
+std::weak_ptr<Sinks> sharedSinks;
+
+std::shared_ptr<Sinks> acquireSinks()
+{
+    std::lock_guard<std::mutex> lk(sinksMutex);
+    std::shared_ptr<Sinks> sinks = sharedSinks.lock();
+    if (!sinks)
+    {
+        sinks = std::make_shared<Sinks>();
+        sharedSinks = sinks;
+    }
+    return sinks;
+}
+
+//the last handle drains and stops the writers under the lock, a new connect waits for them instead of racing
+void releaseSinks(std::shared_ptr<Sinks> &sinks)
+{
+    std::lock_guard<std::mutex> lk(sinksMutex);
+    sinks.reset();
+}
+
+}
+
+struct bulk_handle
+{
+    explicit bulk_handle(int bulkSize)
+        : sinks(acquireSinks())
+        , parser(std::tie(*sinks), bulkSize, 1)
+    { }
+
+    std::shared_ptr<Sinks> sinks;
+    BasicParser<Sinks> parser;
+};
+
+extern "C" bulk_handle *bulk_connect(size_t bulk_size)
+{
+    if (bulk_size == 0 || bulk_size > INT_MAX)
+        return nullptr;
+
+    try
+    {
+        return new bulk_handle(static_cast<int>(bulk_size));
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+
+extern "C" int bulk_receive(bulk_handle *handle, const void *data, size_t size)
+{
+    if (!handle)
+        return -1;
+
+    try
+    {
+        handle->parser.feed(static_cast<const char *>(data), size);
+        return 0;
+    }
+    catch (...)
+    {
+        return -1;
+    }
+}
+
+extern "C" int bulk_disconnect(bulk_handle *handle)
+{
+    if (!handle)
+        return -1;
+
+    int result = 0;
+    try
+    {
+        handle->parser.finish();
+    }
+    catch (...)
+    {
+        result = -1;
+    }
+
+    std::shared_ptr<Sinks> sinks = std::move(handle->sinks);
+    delete handle;
+    releaseSinks(sinks);
+    return result;
+}
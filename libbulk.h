@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//one input stream with its own bulk accumulation and {} nesting
+typedef struct bulk_handle bulk_handle;
+
+//opens a stream that cuts static bulks of bulk_size commands, NULL on failure
+//all streams of the process share one ScreenWriter and one FileWriter, started by the first
+//bulk_connect and stopped by the last bulk_disconnect
+bulk_handle *bulk_connect(size_t bulk_size);
+
+//parses size bytes of input, chunks may end anywhere - also in the middle of a line
+//data is not kept after the call, only the bytes of a line left unfinished are carried over
+//a handle is used by one thread at a time, different handles may be fed concurrently
+//returns 0, or -1 on a NULL handle or failure
+int bulk_receive(bulk_handle *handle, const void *data, size_t size);
+
+//ends the stream like the end of stdin: the last line and the top-level bulk are published,
+//an unclosed block is dropped; the handle is freed, returns 0 or -1 on a NULL handle
+int bulk_disconnect(bulk_handle *handle);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,83 @@
+//ctest of the c api: two handles get the same input in small interleaved chunks that end mid-line and mid-{,
+//after the last bulk_disconnect every bulk must already be on screen and in the files
+//stdout: the screen lines of the writers, then "drained" and the contents of the bulk*.log files in the directory
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libbulk.h"
+
+static char *readInput(const char *path, size_t *size)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return NULL;
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *data = malloc(length > 0 ? (size_t)length : 1);
+    *size = data ? fread(data, 1, (size_t)length, file) : 0;
+    fclose(file);
+    return data;
+}
+
+static int printLogs(void)
+{
+    DIR *directory = opendir(".");
+    if (!directory)
+        return -1;
+    for (struct dirent *entry; (entry = readdir(directory)) != NULL;)
+    {
+        size_t length = strlen(entry->d_name);
+        if (strncmp(entry->d_name, "bulk", 4) != 0 || length < 4 || strcmp(entry->d_name + length - 4, ".log") != 0)
+            continue;
+        size_t size;
+        char *data = readInput(entry->d_name, &size);
+        if (!data)
+            return -1;
+        fwrite(data, 1, size, stdout);
+        free(data);
+    }
+    closedir(directory);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: %s INPUT\n", argv[0]);
+        return 1;
+    }
+    size_t size;
+    char *input = readInput(argv[1], &size);
+    if (!input)
+        return 1;
+
+    bulk_handle *handles[2] = { bulk_connect(3), bulk_connect(3) };
+    if (!handles[0] || !handles[1])
+        return 1;
+
+    //chunk sizes cycle so that every offset of every line, the { and } lines included, ends a chunk somewhere
+    static const size_t chunks[] = { 1, 2, 3, 5, 7, 11 };
+    size_t offsets[2] = { 0, 0 };
+    for (size_t turn = 0; offsets[0] < size || offsets[1] < size; ++turn)
+    {
+        size_t h = turn % 2;
+        size_t part = chunks[(turn / 2 + h) % (sizeof(chunks) / sizeof(chunks[0]))];
+        if (part > size - offsets[h])
+            part = size - offsets[h];
+        if (bulk_receive(handles[h], input + offsets[h], part) != 0)
+            return 1;
+        offsets[h] += part;
+    }
+    free(input);
+
+    if (bulk_disconnect(handles[0]) != 0 || bulk_disconnect(handles[1]) != 0)
+        return 1;
+
+    //the writers are stopped by now: nothing may reach the screen after this line or the files after this read
+    printf("drained\n");
+    return printLogs() == 0 ? 0 : 1;
+}
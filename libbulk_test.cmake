@@ -0,0 +1,78 @@
+#проверка ctest для c api: bulkmt_libbulk_test и bulkmt на одном входе должны дать одни и те же блоки
+#cmake -DBULKMT=... -DLIBBULK_TEST=... -DINPUT=bulk1.txt -DWORK_DIR=... -P libbulk_test.cmake
+foreach(name BULKMT LIBBULK_TEST INPUT WORK_DIR)
+  if(NOT DEFINED ${name})
+    message(FATAL_ERROR "${name} is not set")
+  endif()
+endforeach()
+
+file(REMOVE_RECURSE ${WORK_DIR})
+file(MAKE_DIRECTORY ${WORK_DIR}/cli ${WORK_DIR}/api)
+
+#строки "bulk:" из текста, без номера потока в начале, отсортированные
+function(bulk_lines text out)
+  string(REPLACE "\n" ";" lines "${text}")
+  set(bulks "")
+  foreach(line IN LISTS lines)
+    if(line MATCHES "^([0-9]+ )?(bulk:.*)$")
+      list(APPEND bulks "${CMAKE_MATCH_2}")
+    endif()
+  endforeach()
+  list(SORT bulks)
+  set(${out} "${bulks}" PARENT_SCOPE)
+endfunction()
+
+function(log_contents directory out)
+  file(GLOB logs ${directory}/bulk*.log)
+  set(text "")
+  foreach(log IN LISTS logs)
+    file(READ ${log} content)
+    set(text "${text}${content}")
+  endforeach()
+  set(${out} "${text}" PARENT_SCOPE)
+endfunction()
+
+execute_process(COMMAND ${BULKMT} 3 --quiet-paths
+  INPUT_FILE ${INPUT}
+  OUTPUT_VARIABLE cli
+  RESULT_VARIABLE result
+  WORKING_DIRECTORY ${WORK_DIR}/cli)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "bulkmt exited with ${result}")
+endif()
+string(REGEX REPLACE "\nMAIN\n.*" "" cli "${cli}")
+log_contents(${WORK_DIR}/cli cliLogs)
+
+execute_process(COMMAND ${LIBBULK_TEST} ${INPUT}
+  OUTPUT_VARIABLE api
+  RESULT_VARIABLE result
+  WORKING_DIRECTORY ${WORK_DIR}/api)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "bulkmt_libbulk_test exited with ${result}:\n${api}")
+endif()
+string(FIND "${api}" "drained\n" split)
+if(split LESS 0)
+  message(FATAL_ERROR "no drained marker in the output:\n${api}")
+endif()
+string(SUBSTRING "${api}" 0 ${split} apiScreen)
+math(EXPR split "${split} + 8")
+string(SUBSTRING "${api}" ${split} -1 apiLogs)
+if(apiLogs MATCHES "(^|\n)[0-9]+ bulk:")
+  message(FATAL_ERROR "the screen wrote after the last bulk_disconnect returned:\n${apiLogs}")
+endif()
+
+#оба дескриптора получили весь вход, каждый блок CLI должен прийти дважды
+bulk_lines("${cli}${cli}" expectedScreen)
+bulk_lines("${apiScreen}" actualScreen)
+if(NOT expectedScreen STREQUAL actualScreen)
+  message(FATAL_ERROR "screen differs from bulkmt\nexpected: ${expectedScreen}\nactual: ${actualScreen}")
+endif()
+bulk_lines("${cliLogs}${cliLogs}" expectedFiles)
+bulk_lines("${apiLogs}" actualFiles)
+if(NOT expectedFiles STREQUAL actualFiles)
+  message(FATAL_ERROR "files differ from bulkmt\nexpected: ${expectedFiles}\nactual: ${actualFiles}")
+endif()
+if(NOT actualFiles)
+  message(FATAL_ERROR "no bulks were written")
+endif()
+file(REMOVE_RECURSE ${WORK_DIR})
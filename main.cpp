@@ -1,380 +1,538 @@
-#include <list>
+#include <cctype>
+#include <cstdlib>
 #include <iostream>
-#include <fstream>
-#include <functional>
-#include <stdlib.h>
-#include <ctime>
-#include <unistd.h>
+#include <memory>
+#include <string>
 #include <thread>
+#include <tuple>
 #include <vector>
-#include <map>
-#include <mutex>
-#include <condition_variable>
 
-using Bulk = std::list<std::string>;
+#include "parser.h"
+#include "server.h"
+#include "screenwriter.h"
+#include "filewriter.h"
+#include "metrics.h"
+#include "trace.h"
+#include "checkpoint.h"
+#include "affinity.h"
 
-template<typename T>
-class Worker
+struct Options
 {
-public:
-    Worker(std::function<void(T)> workFunction) : m_running(false), m_workFunction(workFunction)
-    {
-        start();
-    }
+    int bulkSize = 5;
+    std::size_t queueCapacity = 0; //per worker, 0 keeps file queues unbounded
+    OverflowPolicy overflow = OverflowPolicy::Block;
+    DispatchPolicy dispatch = DispatchPolicy::RoundRobin;
+    int fileWorkers = 2;
+    std::size_t executorThreads = 0; //sinks run as lanes of one shared pool, 0 gives every worker its own thread
+    CpuSet parserCpus;   //the parsing thread and every thread it starts
+    CpuSet executorCpus; //pool thread i on the i-th cpu
+    AutoscaleOptions autoscale;
+    FileOutputOptions output;
+    ScreenOptions screen;
+    InputMode input = InputMode::Auto;
+    std::size_t parseThreads = 0; //0 uses every hardware thread
+    std::size_t parseChunkBytes = 16 << 20;
+    FlushOptions flush;
+    std::vector<std::string> listen; //server mode when not empty
+    bool mergeStatic = false;
+    bool detailedStats = false;
+    MetricsOptions metrics;
+    std::string trace; //Chrome trace JSON written at exit, needs a BULKMT_TRACE build
+    std::size_t internCommands = 0; //dictionary size for repeated commands, 0 copies every command
+    std::chrono::milliseconds drainTimeout{0}; //how long the sinks may drain at exit, 0 writes everything
+    std::string checkpoint; //keeps what the drain left for the next run, replayed at start
+};
 
-    Worker(Worker &&other)
-    {
-        m_workFunction = std::move(other.m_workFunction);
-        m_queue = std::move(other.m_queue);
-        start();
-    }
+bool parseOverflowPolicy(const std::string &value, OverflowPolicy &policy)
+{
+    if (value == "block")
+        policy = OverflowPolicy::Block;
+    else if (value == "drop-oldest")
+        policy = OverflowPolicy::DropOldest;
+    else if (value == "spill")
+        policy = OverflowPolicy::Spill;
+    else
+        return false;
+    return true;
+}
 
-    ~Worker()
-    {
-        stop();
-    }
+bool parseDispatchPolicy(const std::string &value, DispatchPolicy &policy)
+{
+    if (value == "round-robin")
+        policy = DispatchPolicy::RoundRobin;
+    else if (value == "least-queued")
+        policy = DispatchPolicy::LeastQueued;
+    else if (value == "least-bytes")
+        policy = DispatchPolicy::LeastBytes;
+    else if (value == "work-stealing")
+        policy = DispatchPolicy::WorkStealing;
+    else
+        return false;
+    return true;
+}
 
-    void push_back(T commands)
-    {
-        {
-            std::lock_guard<std::mutex> lk(m_mutex);
-            m_queue.push_back(commands);
-        }
-        m_condition.notify_all();
-    }
+//MIN:MAX worker count
+bool parseRange(const std::string &value, std::size_t &min, std::size_t &max)
+{
+    char *p;
+    min = std::strtoul(value.c_str(), &p, 10);
+    if (*p != ':')
+        return false;
+    max = std::strtoul(p + 1, &p, 10);
+    return *p == '\0' && max != 0 && min <= max;
+}
 
-    void start()
-    {
-        {
-            std::lock_guard<std::mutex> lk(m_mutex);
-            if (m_running == true) return;
-            m_running = true;
-        }
+bool parseInputMode(const std::string &value, InputMode &mode)
+{
+    if (value == "auto")
+        mode = InputMode::Auto;
+    else if (value == "stream")
+        mode = InputMode::Stream;
+    else if (value == "read")
+        mode = InputMode::Read;
+    else if (value == "mmap")
+        mode = InputMode::Mmap;
+    else if (value == "parallel")
+        mode = InputMode::Parallel;
+    else
+        return false;
+    return true;
+}
 
-        m_thread = std::thread([this]
-        {
-            for (;;)
-            {
-                decltype(m_queue) local_queue;
-                {
-                    std::unique_lock<std::mutex> lk(m_mutex);
-                    m_condition.wait(lk, [&] { return !m_queue.empty() + !m_running; });
-
-                    if (!m_running)
-                    {
-                        for (auto& data : m_queue)
-                            m_workFunction(data);
-
-                        m_queue.clear();
-                        return;
-                    }
-
-                    local_queue = std::move(m_queue);
-                }
-
-                for (auto& data : local_queue)
-                    m_workFunction(data);
-            }
-        });
-        m_thread_id = m_thread.get_id();
-    }
+bool parseIoBackend(const std::string &value, IoBackend &backend)
+{
+    if (value == "threads")
+        backend = IoBackend::Threads;
+    else if (value == "uring")
+        backend = IoBackend::Uring;
+    else if (value == "pipe")
+        backend = IoBackend::Pipe;
+    else
+        return false;
+    return true;
+}
 
-    void stop()
-    {
-        {
-            std::lock_guard<std::mutex> lk(m_mutex);
-            if (m_running == false) return;
-            m_running = false;
-        }
+bool parseDurability(const std::string &value, Durability &durability)
+{
+    if (value == "none")
+        durability = Durability::None;
+    else if (value == "per-bulk")
+        durability = Durability::PerBulk;
+    else if (value == "group")
+        durability = Durability::Group;
+    else if (value == "per-rotation")
+        durability = Durability::PerRotation;
+    else
+        return false;
+    return true;
+}
 
-        m_condition.notify_all();
-        m_thread.join();
-    }
+bool parseLogFormat(const std::string &value, LogFormat &format)
+{
+    if (value == "text")
+        format = LogFormat::Text;
+    else if (value == "binary")
+        format = LogFormat::Binary;
+    else
+        return false;
+    return true;
+}
 
-    std::thread::id getThreadId ()
-    {
-        return m_thread_id;
-    }
-private:
-    std::function<void(T)> m_workFunction;
-    std::condition_variable m_condition;
-    std::list<Bulk> m_queue;
-    std::mutex m_mutex;
-    std::thread m_thread;
-    std::thread::id m_thread_id; //save thread id after thread stopped
-    bool m_running = false;
-};
+bool parseCompression(const std::string &value, Compression &compression)
+{
+    if (value == "none")
+        compression = Compression::None;
+    else if (value == "deflate")
+        compression = Compression::Deflate;
+    else
+        return false;
+    return true;
+}
 
-class Parser
+bool parseOutputMode(const std::string &value, OutputMode &mode)
 {
-    enum class ParsingState
+    if (value == "per-bulk")
+        mode = OutputMode::PerBulk;
+    else if (value == "append")
+        mode = OutputMode::Append;
+    else
+        return false;
+    return true;
+}
+
+//every --some-option can also be set as BULKMT_SOME_OPTION, the command line wins
+//flags are enabled by any value except 0
+std::vector<std::string> collectArguments(int argc, const char *argv[])
+{
+    struct Known
     {
-        TopLevel = 0,
-        InBlock = 1
+        const char *name;
+        bool flag;
     };
-
-public:
-    Parser (int bulkSize)
-        : m_bulkSize(bulkSize)
-        , m_lineCount(0)
-        , m_commandCount(0)
-        , m_blockCount(0)
-    { }
-
-    void exec()
+    static const Known known[] = { { "bulk-size", false }, { "queue-capacity", false }, { "overflow", false },
+                                   { "dispatch", false }, { "file-workers", false }, { "executor-threads", false }, { "autoscale", false },
+                                   { "parser-cpus", false }, { "screen-cpus", false }, { "file-cpus", false },
+                                   { "executor-cpus", false },
+                                   { "autoscale-target-ms", false }, { "output", false }, { "rotate-bytes", false },
+                                   { "rotate-seconds", false }, { "index", true }, { "output-dir", false },
+                                   { "quiet-paths", true }, { "sequence-names", true }, { "io-backend", false },
+                                   { "format", false }, { "compress", false },
+                                   { "durability", false }, { "sync-bulks", false }, { "sync-ms", false }, { "screen-batch", true }, { "screen-pipe", true },
+                                   { "screen-flush-ms", false },
+                                   { "input", false }, { "parse-threads", false },
+                                   { "parse-chunk-kb", false }, { "flush-ms", false }, { "flush-bytes", false },
+                                   { "listen", false }, { "merge-static", true },
+                                   { "detailed-stats", true }, { "metrics-listen", false }, { "stats-interval", false },
+                                   { "trace", false }, { "intern", false }, { "drain-ms", false },
+                                   { "checkpoint", false } };
+
+    std::vector<std::string> args;
+    for (const Known &option : known)
     {
-        ParsingState state = ParsingState::TopLevel;
-        Bulk commands;
-        int depthCounter = 0;
+        std::string variable = "BULKMT_" + std::string(option.name);
+        for (auto &c : variable)
+            c = c == '-' ? '_' : std::toupper(c);
 
-        for(std::string line; std::getline(std::cin, line);)
-        {
-            m_lineCount++;
-            switch (state)
-            {
-            case ParsingState::TopLevel:
-            {
-                if (line != "{")
-                {
-                    commands.push_back(line);
-                    if (commands.size() == m_bulkSize)
-                        publish(commands);
-                    break;
-                }
-                else
-                {
-                    depthCounter++;
-                    publish(commands);
-                    state = ParsingState::InBlock;
-                    break;
-                }
-            }
-            case ParsingState::InBlock:
-            {
-                if (line != "}")
-                {
-                    if (line == "{")
-                        depthCounter++;
-                    else
-                        commands.push_back(line);
-                }
-                else
-                {
-                    depthCounter--;
-                    if (depthCounter == 0)
-                    {
-                        publish(commands);
-                        state = ParsingState::TopLevel;
-                    }
-                }
-                break;
-            }
-            default:
-                break;
-            }
-        }
+        const char *value = std::getenv(variable.c_str());
+        if (!value || (option.flag && std::string(value) == "0"))
+            continue;
 
-        if (state == ParsingState::TopLevel)
-            publish(commands);
-    }
-
-    void subscribe(const std::function<void(Bulk)>& callback)
-    {
-        m_subscribers.push_back(callback);
+        args.push_back(std::string("--") + option.name);
+        if (!option.flag)
+            args.push_back(value);
     }
+    for (int i = 1; i < argc; ++i)
+        args.push_back(argv[i]);
+    return args;
+}
 
-    void publish(Bulk &commands)
+bool parseOptions(int argc, const char *argv[], Options &options)
+{
+    std::vector<std::string> args = collectArguments(argc, argv);
+    for (std::size_t i = 0; i < args.size(); ++i)
     {
-        if (commands.size() == 0)
-            return;
-
-        m_commandCount += commands.size();
-        m_blockCount++;
+        const std::string &arg = args[i];
+        bool hasValue = i + 1 < args.size();
+        char *p;
 
-        for (const auto& subscriber : m_subscribers)
+        if (arg == "--bulk-size" && hasValue)
+            options.bulkSize = std::strtol(args[++i].c_str(), &p, 10);
+        else if (arg == "--queue-capacity" && hasValue)
+            options.queueCapacity = std::strtoul(args[++i].c_str(), &p, 10);
+        else if (arg == "--overflow" && hasValue)
         {
-            subscriber(commands);
+            if (!parseOverflowPolicy(args[++i], options.overflow))
+                return false;
         }
-        commands.clear();
-    }
-
-    void printStats()
-    {
-        std::cout << std::this_thread::get_id() << " Lines " << m_lineCount << std::endl;
-        std::cout << std::this_thread::get_id() << " Blocks " << m_blockCount << std::endl;
-        std::cout << std::this_thread::get_id() << " Commands " << m_commandCount << std::endl;
+        else if (arg == "--dispatch" && hasValue)
+        {
+            if (!parseDispatchPolicy(args[++i], options.dispatch))
+                return false;
+        }
+        else if (arg == "--file-workers" && hasValue)
+            options.fileWorkers = std::strtol(args[++i].c_str(), &p, 10);
+        else if (arg == "--executor-threads" && hasValue)
+            options.executorThreads = std::strtoul(args[++i].c_str(), &p, 10);
+        else if (arg == "--parser-cpus" && hasValue)
+        {
+            if (!options.parserCpus.parse(args[++i]))
+                return false;
+        }
+        else if (arg == "--screen-cpus" && hasValue)
+        {
+            if (!options.screen.cpus.parse(args[++i]))
+                return false;
+        }
+        else if (arg == "--file-cpus" && hasValue)
+        {
+            if (!options.output.cpus.parse(args[++i]))
+                return false;
+        }
+        else if (arg == "--executor-cpus" && hasValue)
+        {
+            if (!options.executorCpus.parse(args[++i]))
+                return false;
+        }
+        else if (arg == "--autoscale" && hasValue)
+        {
+            if (!parseRange(args[++i], options.autoscale.minWorkers, options.autoscale.maxWorkers))
+                return false;
+        }
+        else if (arg == "--autoscale-target-ms" && hasValue)
+            options.autoscale.targetWait = std::chrono::milliseconds(std::strtol(args[++i].c_str(), &p, 10));
+        else if (arg == "--output" && hasValue)
+        {
+            if (!parseOutputMode(args[++i], options.output.mode))
+                return false;
+        }
+        else if (arg == "--rotate-bytes" && hasValue)
+            options.output.rotateBytes = std::strtoull(args[++i].c_str(), &p, 10);
+        else if (arg == "--rotate-seconds" && hasValue)
+            options.output.rotateInterval = std::chrono::seconds(std::strtol(args[++i].c_str(), &p, 10));
+        else if (arg == "--index")
+            options.output.index = true;
+        else if (arg == "--output-dir" && hasValue)
+            options.output.directory = args[++i];
+        else if (arg == "--format" && hasValue)
+        {
+            if (!parseLogFormat(args[++i], options.output.format))
+                return false;
+        }
+        else if (arg == "--compress" && hasValue)
+        {
+            if (!parseCompression(args[++i], options.output.compression))
+                return false;
+        }
+        else if (arg == "--durability" && hasValue)
+        {
+            if (!parseDurability(args[++i], options.output.durability))
+                return false;
+        }
+        else if (arg == "--sync-bulks" && hasValue)
+            options.output.syncBulks = std::strtoul(args[++i].c_str(), &p, 10);
+        else if (arg == "--sync-ms" && hasValue)
+            options.output.syncInterval = std::chrono::milliseconds(std::strtol(args[++i].c_str(), &p, 10));
+        else if (arg == "--quiet-paths")
+            options.output.echoPaths = false;
+        else if (arg == "--sequence-names")
+            options.output.sequenceNames = true;
+        else if (arg == "--io-backend" && hasValue)
+        {
+            if (!parseIoBackend(args[++i], options.output.backend))
+                return false;
+        }
+        else if (arg == "--input" && hasValue)
+        {
+            if (!parseInputMode(args[++i], options.input))
+                return false;
+        }
+        else if (arg == "--parse-threads" && hasValue)
+            options.parseThreads = std::strtoul(args[++i].c_str(), &p, 10);
+        else if (arg == "--parse-chunk-kb" && hasValue)
+            options.parseChunkBytes = std::strtoul(args[++i].c_str(), &p, 10) << 10;
+        else if (arg == "--flush-ms" && hasValue)
+            options.flush.maxAge = std::chrono::milliseconds(std::strtol(args[++i].c_str(), &p, 10));
+        else if (arg == "--flush-bytes" && hasValue)
+            options.flush.maxBytes = std::strtoull(args[++i].c_str(), &p, 10);
+        else if (arg == "--listen" && hasValue)
+            options.listen.push_back(args[++i]);
+        else if (arg == "--merge-static")
+            options.mergeStatic = true;
+        else if (arg == "--detailed-stats")
+            options.detailedStats = true;
+        else if (arg == "--metrics-listen" && hasValue)
+            options.metrics.listen = args[++i];
+        else if (arg == "--stats-interval" && hasValue)
+            options.metrics.interval = std::chrono::seconds(std::strtol(args[++i].c_str(), &p, 10));
+        else if (arg == "--intern" && hasValue)
+            options.internCommands = std::strtoul(args[++i].c_str(), &p, 10);
+        else if (arg == "--drain-ms" && hasValue)
+            options.drainTimeout = std::chrono::milliseconds(std::strtol(args[++i].c_str(), &p, 10));
+        else if (arg == "--checkpoint" && hasValue)
+            options.checkpoint = args[++i];
+        else if (arg == "--trace" && hasValue)
+            options.trace = args[++i];
+        else if (arg == "--screen-batch")
+            options.screen.batched = true;
+        else if (arg == "--screen-pipe")
+            options.screen.batched = options.screen.pipelined = true;
+        else if (arg == "--screen-flush-ms" && hasValue)
+            options.screen.flushInterval = std::chrono::milliseconds(std::strtol(args[++i].c_str(), &p, 10));
+        else if (arg.compare(0, 2, "--") != 0)
+            options.bulkSize = std::strtol(arg.c_str(), &p, 10);
+        else
+            return false;
     }
+    if (options.output.compression != Compression::None && options.output.format != LogFormat::Binary)
+        return false;
+    return options.bulkSize > 0 && options.fileWorkers > 0;
+}
 
-private:
-    std::list<std::function<void(Bulk)> > m_subscribers;
-    int m_bulkSize;
-
-    int m_lineCount;
-    int m_commandCount;
-    int m_blockCount;
-};
-
-class IBulkHandler
+//$ bulkmt < bulk1.txt
+//$ bulkmt 3 --queue-capacity 100 --overflow spill < bulk1.txt
+//$ BULKMT_FILE_WORKERS=8 bulkmt 3 --autoscale 2:32 < bulk1.txt
+//$ bulkmt 3 --output append --rotate-bytes 67108864 --index < bulk1.txt
+//$ bulkmt 3 --output append --file-workers 1 --io-backend uring < bulk1.txt
+//$ bulkmt 3 --output append --io-backend pipe --screen-pipe < bulk1.txt
+//$ bulkmt 3 --file-workers 8 --executor-threads 2 < bulk1.txt
+//$ bulkmt 3 --parser-cpus node:0 --file-cpus 2-5 --screen-cpus 1 --detailed-stats < bulk1.txt
+//$ bulkmt 3 --output append --durability group --sync-bulks 1000 --sync-ms 20 < bulk1.txt
+//$ bulkmt 3 --output append --format binary --compress deflate < bulk1.txt && bulkmt_decode *.bin
+//$ bulkmt 3 --file-workers 4 --sequence-names < bulk1.txt && cat bulk*.log
+//$ bulkmt 3 --file-workers 4 --output append --format binary < bulk1.txt && bulkmt_decode --merge *.bin
+//$ bulkmt 10 --intern 4096 --output append --format binary < commands.txt
+//$ tail -f commands.txt | bulkmt 100 --flush-ms 50
+//$ bulkmt 3 --trace bulkmt.json < bulk1.txt
+//$ bulkmt 3 --listen 9000 --drain-ms 2000 --checkpoint /var/lib/bulkmt/undrained
+//$ bulkmt 3 --listen unix:/run/bulkmt.sock --listen 9000 --merge-static --metrics-listen 9100
+int main(int argc, const char *argv[])
 {
-public:
-    virtual void push_back(Bulk commands) = 0;
-    virtual void stop() = 0;
-
-    void printStats()
+    Options options;
+    if (!parseOptions(argc, argv, options))
     {
-        std::cout << "Blocks" << std::endl;
-        for (std::map<Worker<Bulk> *,int>::iterator it = m_blockCount.begin(); it!=m_blockCount.end(); ++it)
-            std::cout << "  " << it->first->getThreadId() << " => " << it->second << std::endl;
-
-        std::cout << "Commands" << std::endl;
-        for (std::map<Worker<Bulk> *,int>::iterator it = m_commandCount.begin(); it!=m_commandCount.end(); ++it)
-            std::cout << "  " << it->first->getThreadId() << " => " << it->second << std::endl;
+        std::cerr << "usage: " << argv[0] << " [bulk_size] [--queue-capacity N] [--overflow block|drop-oldest|spill]"
+                  << " [--dispatch round-robin|least-queued|least-bytes|work-stealing]"
+                  << " [--file-workers N] [--executor-threads N] [--autoscale MIN:MAX] [--autoscale-target-ms MS]"
+                  << " [--parser-cpus CPUS] [--screen-cpus CPUS] [--file-cpus CPUS] [--executor-cpus CPUS]"
+                  << " [--output per-bulk|append] [--rotate-bytes N] [--rotate-seconds N] [--index]"
+                  << " [--output-dir DIR] [--quiet-paths] [--sequence-names] [--io-backend threads|uring|pipe]"
+                  << " [--format text|binary] [--compress none|deflate]"
+                  << " [--durability none|per-bulk|group|per-rotation] [--sync-bulks N] [--sync-ms MS]"
+                  << " [--screen-batch] [--screen-pipe] [--screen-flush-ms MS]"
+                  << " [--input auto|stream|read|mmap|parallel] [--parse-threads N] [--parse-chunk-kb N]"
+                  << " [--flush-ms MS] [--flush-bytes N] [--listen unix:PATH|[HOST:]PORT]... [--merge-static]"
+                  << " [--detailed-stats] [--metrics-listen [HOST:]PORT] [--stats-interval SEC] [--trace FILE] [--intern N]"
+                  << " [--drain-ms MS] [--checkpoint PATH]" << std::endl;
+        return 1;
     }
-
-protected:
-
-    void initStats(Worker<Bulk> *worker)
+    if (options.output.compression == Compression::Deflate && !deflateAvailable())
     {
-        if (m_blockCount.find(worker) == m_blockCount.end())
-            m_blockCount.insert( std::pair<Worker<Bulk> *, int>(worker, 0) );
-
-        if (m_commandCount.find(worker) == m_commandCount.end())
-            m_commandCount.insert( std::pair<Worker<Bulk> *, int>(worker, 0) );
+        std::cerr << "--compress deflate needs a build with zlib" << std::endl;
+        return 1;
     }
-
-    void calcStats(Worker<Bulk> *worker, Bulk commands)
+    if (!options.trace.empty() && !traceEnabled())
     {
-        initStats(worker);
-
-        m_blockCount[worker]++;
-        m_commandCount[worker] += commands.size();
+        std::cerr << "--trace needs a build with -DBULKMT_TRACE=ON" << std::endl;
+        return 1;
     }
 
-    std::map<Worker<Bulk> *, int> m_blockCount;
-    std::map<Worker<Bulk> *, int> m_commandCount;
-};
+    //before any thread starts: only the metrics thread takes SIGUSR1 and only the server loop SIGINT and SIGTERM,
+    //each from its signalfd
+    MetricsReporter::blockSignals();
+    if (!options.listen.empty())
+        BulkServer::blockSignals();
 
-class ScreenWriter : public IBulkHandler
-{
-public:
+    //declared first, bulks point into it until the writers are gone
+    CommandDictionary dictionary(options.internCommands);
 
-    ScreenWriter()
-        : m_worker(std::bind(&ScreenWriter::write, this, std::placeholders::_1)) { }
+    //outlives the writers whose lanes it runs
+    std::unique_ptr<Executor> executor;
+    if (options.executorThreads != 0)
+        executor.reset(new Executor(options.executorThreads, options.executorCpus));
 
-    void push_back(Bulk commands)
+    std::unique_ptr<BulkServer> server;
+    if (!options.listen.empty())
     {
-        m_worker.push_back(commands);
-        calcStats(&m_worker, commands);
+        server.reset(new BulkServer(options.bulkSize, options.mergeStatic, options.flush));
+        for (const std::string &address : options.listen)
+        {
+            if (!server->listen(address))
+                return 1;
+        }
     }
 
-    void stop()
-    {
-        m_worker.stop();
-    }
+    MetricsReporter metrics(options.metrics);
+    if (!metrics.open())
+        return 1;
 
-    void write(Bulk commands)
-    {
-        std::cout << std::this_thread::get_id() << " " << "bulk:";
-        for (auto command : commands)
-            std::cout << command << " ";
-        std::cout << std::endl;
-    }
+    ScreenWriter screenWritter(options.queueCapacity ? options.queueCapacity : 1024, options.overflow, options.screen,
+                               executor.get());
+    FileWriter fileWriter(options.fileWorkers, options.queueCapacity, options.overflow, options.dispatch, options.autoscale,
+                          options.output, executor.get());
 
-private:
-    Worker<Bulk> m_worker;
-};
+    BasicParser<ScreenWriter, FileWriter> parser(std::tie(screenWritter, fileWriter), options.bulkSize, options.parseThreads,
+                                                 options.parseChunkBytes, options.flush);
 
-class FileWriter : public IBulkHandler
-{
-public:
-    FileWriter(int wrkCount)
-        : m_roundRobin(0)
+    if (options.internCommands != 0)
     {
-        for (int i = 0; i < wrkCount; ++i)
-        {
-            m_workers.push_back(std::move(Worker<Bulk>(std::bind(&FileWriter::write, this, std::placeholders::_1))));
-        }
+        parser.intern(dictionary);
+        if (server)
+            server->intern(dictionary);
     }
 
-    void push_back(Bulk commands)
+    //bulks the last run could not drain go first, before any new input reaches the sinks
+    Checkpoint checkpoint(options.checkpoint);
+    if (!options.checkpoint.empty())
     {
-        m_workers.at(m_roundRobin).push_back(commands);
-        calcStats(&m_workers.at(m_roundRobin), commands);
-        m_roundRobin++;
-        if (m_roundRobin == m_workers.size())
-            m_roundRobin = 0;
+        std::vector<BulkPtr> screenBulks = checkpoint.load("screen");
+        std::vector<BulkPtr> fileBulks = checkpoint.load("file");
+        for (const BulkPtr &bulk : screenBulks)
+            screenWritter.push_back(bulk);
+        for (const BulkPtr &bulk : fileBulks)
+            fileWriter.push_back(bulk);
+        if (!screenBulks.empty() || !fileBulks.empty())
+            std::cerr << "replayed " << screenBulks.size() << " screen and " << fileBulks.size() << " file bulks from "
+                      << options.checkpoint << std::endl;
     }
 
-    void stop()
+    metrics.watch(server ? server->counters() : parser.counters());
+    if (server)
+        metrics.watch(*server);
+    metrics.watch("screen", screenWritter);
+    metrics.watch("file", fileWriter);
+    metrics.start();
+
+    //the sinks have placed their own threads, whatever starts from here on inherits the parser's cpus
+    if (!options.parserCpus.empty() && !options.parserCpus.pin())
+        std::cerr << "cannot pin the parser" << std::endl;
+
+    //bulkmt_allocs counts from the first line to the last write, setup and checkpoint replay stay out
+    resetAllocations();
     {
-        for (int i = 0; i < m_workers.size(); ++i)
+        AllocScope scope(AllocSite::Parser);
+        if (server)
         {
-            initStats(&m_workers.at(i)); //init empty stats for all workers without executed commands
-            m_workers.at(i).stop();
+            server->subscribe(screenWritter);
+            server->subscribe(fileWriter);
+            server->run();
         }
+        else
+            parser.exec(options.input);
     }
 
-    void write(Bulk commands)
-    {
-        static int conflictResolverCounter = 0;
-        static std::mutex conflictMutex;
-
-        std::ofstream logFile;
+    std::chrono::steady_clock::time_point deadline;
+    if (options.drainTimeout.count() != 0)
+        deadline = std::chrono::steady_clock::now() + options.drainTimeout;
+    stopAll({ &screenWritter, &fileWriter }, deadline);
+    AllocTotals allocations = allocationTotals();
+    metrics.stop();
 
-        std::time_t result = std::time(nullptr);
-        char buff[FILENAME_MAX];
-        getcwd(buff, FILENAME_MAX );
-        std::string current_working_dir(buff);
+    bool saved = true;
+    if (options.drainTimeout.count() != 0 || !options.checkpoint.empty())
+    {
+        std::vector<BulkPtr> screenBulks = screenWritter.undrained();
+        std::vector<BulkPtr> fileBulks = fileWriter.undrained();
+        if (!options.checkpoint.empty())
         {
-            std::lock_guard<std::mutex> lk(conflictMutex);
-            logFile.open (std::string(current_working_dir + "/bulk" + std::to_string(result) + "_" + std::to_string(conflictResolverCounter) + ".log"));
-            std::cout << std::this_thread::get_id() << " " << std::string(current_working_dir + "/bulk" + std::to_string(result) + "_" + std::to_string(conflictResolverCounter) + ".log") << std::endl;
-            conflictResolverCounter++;
+            saved = checkpoint.save("screen", screenBulks) && checkpoint.save("file", fileBulks);
+            if (!saved)
+                std::cerr << "cannot write checkpoint " << options.checkpoint << ", "
+                          << screenBulks.size() + fileBulks.size() << " bulks are lost" << std::endl;
+            else if (!screenBulks.empty() || !fileBulks.empty())
+                std::cerr << "drain deadline passed, " << screenBulks.size() << " screen and " << fileBulks.size()
+                          << " file bulks saved to " << options.checkpoint << std::endl;
         }
-        logFile << "bulk:";
-        for (auto command : commands)
-            logFile << command << " ";
-        logFile << std::endl;
-
-        logFile.close();
+        else if (!screenBulks.empty() || !fileBulks.empty())
+            std::cerr << "drain deadline passed, " << screenBulks.size() << " screen and " << fileBulks.size()
+                      << " file bulks dropped" << std::endl;
     }
 
-private:
-    std::vector<Worker<Bulk> > m_workers;
-    int m_roundRobin;
-};
+    if (!options.trace.empty() && !writeTrace(options.trace))
+        std::cerr << "cannot write trace " << options.trace << std::endl;
 
-//$ bulkmt < bulk1.txt
-int main(int argc, const char *argv[])
-{
-    int bulkCount = 5;
-    if (argc == 2)
+    std::cout << std::endl << "MAIN" << std::endl;
+    if (server)
+        server->printStats();
+    else
+        parser.printStats();
+    if (options.detailedStats)
+        std::cout << std::this_thread::get_id() << " Cpu " << currentCpu() << std::endl;
+    const ParserCounters &counters = server ? server->counters() : parser.counters();
+    if (allocCounting())
     {
-        char *p;
-        bulkCount = std::strtol(argv[1], &p, 10);
+        printAllocations(allocations, AllocSite::Parser, counters.lines, counters.blocks);
+        printAllocations(allocations, counters.lines, counters.blocks);
     }
 
-    Parser parser(bulkCount);
-
-    ScreenWriter screenWritter;
-    parser.subscribe(std::bind(&ScreenWriter::push_back, &screenWritter, std::placeholders::_1));
-
-    FileWriter fileWriter(2); //set file writter thread count here
-    parser.subscribe(std::bind(&FileWriter::push_back, &fileWriter, std::placeholders::_1));
-
-    parser.exec();
-
-    screenWritter.stop();
-    fileWriter.stop();
-
-    std::cout << std::endl << "MAIN" << std::endl;
-    parser.printStats();
-
     std::cout << std::endl << "LOG" << std::endl;
-    screenWritter.printStats();
+    screenWritter.printStats(options.detailedStats);
+    if (allocCounting())
+        printAllocations(allocations, AllocSite::Screen, counters.lines, counters.blocks);
 
     std::cout << std::endl << "FILE" << std::endl;
-    fileWriter.printStats();
+    fileWriter.printStats(options.detailedStats);
+    if (allocCounting())
+        printAllocations(allocations, AllocSite::File, counters.lines, counters.blocks);
 
-    return 0;
+    return saved ? 0 : 1;
 }
@@ -0,0 +1,365 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "handler.h"
+#include "parser.h"
+#include "server.h"
+
+struct MetricsOptions
+{
+    std::string listen;               //serve http://ADDR/metrics in the Prometheus text format, empty for none
+    std::chrono::seconds interval{0}; //a stats line on stderr this often, 0 leaves it to SIGUSR1
+};
+
+//reports a running pipeline: a stats line on stderr on SIGUSR1 or every interval, and a /metrics endpoint
+//it has its own thread and only reads the relaxed counters of the parser and the workers, nothing on
+//the hot path waits for it
+//SIGUSR1 is read through a signalfd by that thread only: blockSignals() before any other thread starts keeps
+//it from interrupting a blocking read or write anywhere else
+class MetricsReporter
+{
+    struct Sink
+    {
+        std::string name;
+        const IBulkHandler *handler;
+        std::uint64_t lastBytes;
+    };
+
+public:
+    explicit MetricsReporter(const MetricsOptions &options = MetricsOptions())
+        : m_options(options)
+        , m_counters(nullptr)
+        , m_server(nullptr)
+        , m_listener(-1)
+        , m_signal(-1)
+        , m_lastLine(std::chrono::steady_clock::now())
+    {
+        m_wake[0] = m_wake[1] = -1;
+    }
+
+    ~MetricsReporter()
+    {
+        stop();
+        if (m_listener >= 0)
+            ::close(m_listener);
+        if (m_signal >= 0)
+            ::close(m_signal);
+        for (int fd : m_wake)
+        {
+            if (fd >= 0)
+                ::close(fd);
+        }
+    }
+
+    //the fallible part, called before the pipeline starts so a taken port fails early
+    bool open()
+    {
+        if (::pipe2(m_wake, O_NONBLOCK | O_CLOEXEC) != 0)
+            return false;
+        sigset_t signals = reportSignals();
+        m_signal = ::signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (m_signal < 0)
+            return false;
+
+        if (!m_options.listen.empty())
+        {
+            m_listener = openListener(m_options.listen);
+            if (m_listener < 0)
+            {
+                std::cerr << "can not serve metrics on " << m_options.listen << ": " << std::strerror(errno) << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    //SIGUSR1 is blocked in the calling thread and in every thread it starts from now on
+    static void blockSignals()
+    {
+        sigset_t signals = reportSignals();
+        ::pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    }
+
+    //all sources must be watched before start and outlive stop
+    void watch(const ParserCounters &counters) { m_counters = &counters; }
+    void watch(const BulkServer &server) { m_server = &server; }
+    void watch(const std::string &name, const IBulkHandler &handler) { m_sinks.push_back(Sink{name, &handler, 0}); }
+
+    void start()
+    {
+        if (m_wake[1] < 0 || m_thread.joinable())
+            return;
+
+        m_thread = std::thread(&MetricsReporter::run, this);
+    }
+
+    void stop()
+    {
+        if (!m_thread.joinable())
+            return;
+
+        wake('q');
+        m_thread.join();
+    }
+
+    //one line with the totals and, per sink, queue depths, latency and write throughput since the last line
+    std::string line()
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        double seconds = std::chrono::duration<double>(now - m_lastLine).count();
+        m_lastLine = now;
+
+        std::ostringstream out;
+        out << "metrics";
+        if (m_counters)
+            out << " lines=" << m_counters->lines << " blocks=" << m_counters->blocks << " commands=" << m_counters->commands;
+        if (m_server)
+            out << " connections=" << m_server->connectionCount();
+
+        for (Sink &sink : m_sinks)
+        {
+            std::uint64_t counts[WorkerStats::LatencyBuckets] = {};
+            std::uint64_t bytes = 0;
+            std::uint64_t highWater = 0;
+            out << " " << sink.name << ": depth=";
+
+            std::vector<IWorker *> workers = sink.handler->workers();
+            for (std::size_t i = 0; i < workers.size(); ++i)
+            {
+                const WorkerStats &stats = workers[i]->stats();
+                for (std::size_t bucket = 0; bucket < WorkerStats::LatencyBuckets; ++bucket)
+                    counts[bucket] += stats.latency(bucket);
+                bytes += stats.writtenBytes();
+                highWater = std::max(highWater, stats.highWater());
+                out << (i ? "," : "") << workers[i]->pending();
+            }
+
+            double rate = seconds > 0 ? (bytes - sink.lastBytes) / seconds : 0;
+            sink.lastBytes = bytes;
+            out << " high-water=" << highWater << " p50=" << WorkerStats::percentile(counts, 0.5).count()
+                << "us p99=" << WorkerStats::percentile(counts, 0.99).count() << "us written=" << bytes
+                << " bytes " << static_cast<std::uint64_t>(rate) << " B/s";
+        }
+        out << "\n";
+        return out.str();
+    }
+
+    //Prometheus text exposition format 0.0.4
+    std::string prometheus() const
+    {
+        std::ostringstream out;
+        if (m_counters)
+        {
+            counter(out, "bulkmt_lines_total", "input lines parsed", m_counters->lines);
+            counter(out, "bulkmt_blocks_total", "bulks published", m_counters->blocks);
+            counter(out, "bulkmt_commands_total", "commands published", m_counters->commands);
+        }
+        if (m_server)
+        {
+            out << "# HELP bulkmt_connections open connections\n# TYPE bulkmt_connections gauge\n"
+                << "bulkmt_connections " << m_server->connectionCount() << "\n";
+            counter(out, "bulkmt_connections_accepted_total", "connections accepted", m_server->acceptedCount());
+        }
+
+        std::vector<std::vector<IWorker *> > workers;
+        for (const Sink &sink : m_sinks)
+            workers.push_back(sink.handler->workers());
+
+        family(out, workers, "bulkmt_queue_depth", "gauge", "bulks queued or in progress",
+               [](IWorker &worker) { return static_cast<std::uint64_t>(worker.pending()); });
+        family(out, workers, "bulkmt_queue_high_water", "gauge", "deepest the queue has been",
+               [](IWorker &worker) { return worker.stats().highWater(); });
+        family(out, workers, "bulkmt_overflow_total", "counter", "times the overflow policy fired",
+               [](IWorker &worker) { return static_cast<std::uint64_t>(worker.overflowCount()); });
+        family(out, workers, "bulkmt_written_blocks_total", "counter", "bulks written by the worker",
+               [](IWorker &worker) { return worker.stats().writtenBlocks(); });
+        family(out, workers, "bulkmt_written_commands_total", "counter", "commands written by the worker",
+               [](IWorker &worker) { return worker.stats().writtenCommands(); });
+        family(out, workers, "bulkmt_written_bytes_total", "counter", "command bytes written by the worker",
+               [](IWorker &worker) { return worker.stats().writtenBytes(); });
+
+        out << "# HELP bulkmt_latency_seconds publish to write latency\n# TYPE bulkmt_latency_seconds histogram\n";
+        for (std::size_t s = 0; s < m_sinks.size(); ++s)
+        {
+            for (std::size_t i = 0; i < workers[s].size(); ++i)
+            {
+                const WorkerStats &stats = workers[s][i]->stats();
+                std::string labels = "sink=\"" + m_sinks[s].name + "\",worker=\"" + std::to_string(i) + "\"";
+                std::uint64_t cumulative = 0;
+                for (std::size_t bucket = 0; bucket + 1 < WorkerStats::LatencyBuckets; ++bucket)
+                {
+                    cumulative += stats.latency(bucket);
+                    out << "bulkmt_latency_seconds_bucket{" << labels << ",le=\"" << (std::uint64_t(1) << bucket) / 1e6
+                        << "\"} " << cumulative << "\n";
+                }
+                cumulative += stats.latency(WorkerStats::LatencyBuckets - 1);
+                out << "bulkmt_latency_seconds_bucket{" << labels << ",le=\"+Inf\"} " << cumulative << "\n"
+                    << "bulkmt_latency_seconds_sum{" << labels << "} "
+                    << std::chrono::duration<double>(stats.latencySum()).count() << "\n"
+                    << "bulkmt_latency_seconds_count{" << labels << "} " << cumulative << "\n";
+            }
+        }
+        return out.str();
+    }
+
+private:
+    static sigset_t reportSignals()
+    {
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGUSR1);
+        return signals;
+    }
+
+    void wake(char reason)
+    {
+        ssize_t written = ::write(m_wake[1], &reason, 1);
+        (void)written;
+    }
+
+    static void counter(std::ostringstream &out, const char *name, const char *help, std::uint64_t value)
+    {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " counter\n" << name << " " << value << "\n";
+    }
+
+    template<typename Value>
+    void family(std::ostringstream &out, const std::vector<std::vector<IWorker *> > &workers, const char *name,
+                const char *type, const char *help, Value &&value) const
+    {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+        for (std::size_t s = 0; s < m_sinks.size(); ++s)
+        {
+            for (std::size_t i = 0; i < workers[s].size(); ++i)
+                out << name << "{sink=\"" << m_sinks[s].name << "\",worker=\"" << i << "\"} " << value(*workers[s][i]) << "\n";
+        }
+    }
+
+    void run()
+    {
+        pollfd events[3] = { { m_wake[0], POLLIN, 0 }, { m_signal, POLLIN, 0 }, { m_listener, POLLIN, 0 } };
+        nfds_t count = m_listener >= 0 ? 3 : 2;
+        bool timed = m_options.interval.count() > 0;
+        std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now() + m_options.interval;
+
+        for (;;)
+        {
+            int timeout = -1;
+            if (timed)
+            {
+                auto left = std::chrono::duration_cast<std::chrono::milliseconds>(next - std::chrono::steady_clock::now());
+                timeout = static_cast<int>(std::max<std::chrono::milliseconds::rep>(left.count(), 0));
+            }
+
+            int ready = ::poll(events, count, timeout);
+            if (ready < 0 && errno != EINTR)
+                return;
+
+            if (timed && std::chrono::steady_clock::now() >= next)
+            {
+                next += m_options.interval;
+                report();
+            }
+
+            if (ready > 0 && (events[0].revents & POLLIN))
+            {
+                char reasons[64];
+                for (ssize_t got; (got = ::read(m_wake[0], reasons, sizeof(reasons))) > 0;)
+                {
+                    for (ssize_t i = 0; i < got; ++i)
+                    {
+                        if (reasons[i] == 'q')
+                            return;
+                    }
+                }
+            }
+
+            if (ready > 0 && (events[1].revents & POLLIN))
+            {
+                signalfd_siginfo info;
+                while (::read(m_signal, &info, sizeof(info)) == static_cast<ssize_t>(sizeof(info)))
+                    report();
+            }
+
+            if (ready > 0 && count == 3 && (events[2].revents & POLLIN))
+                serve();
+        }
+    }
+
+    void report()
+    {
+        std::string text = line();
+        std::cerr.write(text.data(), text.size());
+        std::cerr.flush();
+    }
+
+    //one request per connection, a scrape that stalls for a second is dropped
+    void serve()
+    {
+        int fd = ::accept4(m_listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0)
+            return;
+
+        timeval limit = { 1, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof(limit));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &limit, sizeof(limit));
+
+        std::string request;
+        char buffer[1024];
+        while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192)
+        {
+            ssize_t got = ::recv(fd, buffer, sizeof(buffer), 0);
+            if (got <= 0)
+                break;
+            request.append(buffer, got);
+        }
+
+        std::string status = "200 OK";
+        std::string body;
+        if (request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 13, "GET /metrics?") == 0)
+            body = prometheus();
+        else
+        {
+            status = "404 Not Found";
+            body = "try /metrics\n";
+        }
+
+        std::string response = "HTTP/1.0 " + status + "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+                             + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        for (std::size_t sent = 0; sent < response.size();)
+        {
+            ssize_t put = ::send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (put <= 0)
+                break;
+            sent += put;
+        }
+        ::close(fd);
+    }
+
+    MetricsOptions m_options;
+    const ParserCounters *m_counters;
+    const BulkServer *m_server;
+    std::vector<Sink> m_sinks;
+    int m_listener;
+    int m_signal; //signalfd of SIGUSR1
+    int m_wake[2];
+    std::chrono::steady_clock::time_point m_lastLine;
+    std::thread m_thread;
+};
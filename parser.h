@@ -0,0 +1,685 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bulk.h"
+#include "handler.h"
+#include "trace.h"
+
+enum class InputMode
+{
+    Auto = 0,    //mmap a regular file, read(2) anything else
+    Stream = 1,  //std::getline on std::cin, the original reader
+    Read = 2,    //large read(2) blocks
+    Mmap = 3,    //map the whole input, falls back to read(2) when stdin can not be mapped
+    Parallel = 4 //map the whole input and parse chunks of it on several threads
+};
+
+//early publishing of a top-level bulk that has not reached bulk_size yet, both limits off by default
+struct FlushOptions
+{
+    std::chrono::milliseconds maxAge{0}; //publish once the oldest command has waited this long
+    std::size_t maxBytes = 0;            //publish once the commands take this many bytes
+};
+
+//the {/} state machine, shared by the sequential parser and the parallel chunk parsers
+//publish(std::unique_ptr<Bulk>&) takes a finished bulk and leaves a fresh one in its place
+class BulkAssembler
+{
+public:
+    enum class ParsingState
+    {
+        TopLevel = 0,
+        InBlock = 1
+    };
+
+    BulkAssembler(const std::shared_ptr<BulkPool> &pool, int bulkSize, std::size_t maxBytes = 0)
+        : m_pool(pool)
+        , m_bulkSize(bulkSize)
+        , m_maxBytes(maxBytes)
+        , m_state(ParsingState::TopLevel)
+        , m_depthCounter(0)
+        , m_carried(0)
+        , m_commands(pool->acquire())
+    { }
+
+    template<typename Publish>
+    void processLine(const char *line, std::size_t size, Publish &&publish)
+    {
+        switch (m_state)
+        {
+        case ParsingState::TopLevel:
+        {
+            if (!isLine(line, size, '{'))
+            {
+                push(line, size);
+                if (m_carried + m_commands->size() == static_cast<std::size_t>(m_bulkSize)
+                        || (m_maxBytes && m_commands->bytes() >= m_maxBytes))
+                    flush(publish);
+                break;
+            }
+            else
+            {
+                m_depthCounter++;
+                flush(publish);
+                m_state = ParsingState::InBlock;
+                break;
+            }
+        }
+        case ParsingState::InBlock:
+        {
+            if (!isLine(line, size, '}'))
+            {
+                if (isLine(line, size, '{'))
+                    m_depthCounter++;
+                else
+                    push(line, size);
+            }
+            else
+            {
+                m_depthCounter--;
+                if (m_depthCounter == 0)
+                {
+                    flush(publish);
+                    m_state = ParsingState::TopLevel;
+                }
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    //continue from a known position, carried top-level commands are already collected somewhere else
+    void restart(int depth, std::size_t carried, std::unique_ptr<Bulk> commands)
+    {
+        m_depthCounter = depth;
+        m_state = depth > 0 ? ParsingState::InBlock : ParsingState::TopLevel;
+        m_carried = depth > 0 ? 0 : carried;
+        m_commands = commands ? std::move(commands) : m_pool->acquire();
+    }
+
+    static bool isLine(const char *line, std::size_t size, char brace)
+    {
+        return size == 1 && line[0] == brace;
+    }
+
+    //commands known to dictionary are added by reference, nullptr copies every command
+    void intern(CommandDictionary *dictionary)
+    {
+        m_dictionary = dictionary;
+    }
+
+    ParsingState state() const { return m_state; }
+    int depth() const { return m_depthCounter; }
+    std::unique_ptr<Bulk> &commands() { return m_commands; }
+
+private:
+    void push(const char *line, std::size_t size)
+    {
+        std::uint32_t id = m_dictionary ? m_dictionary->intern(line, size) : 0;
+        if (id)
+            m_commands->push_back(m_dictionary->command(id), id);
+        else
+            m_commands->push_back(line, size);
+    }
+
+    template<typename Publish>
+    void flush(Publish &&publish)
+    {
+        publish(m_commands);
+        m_carried = 0;
+    }
+
+    std::shared_ptr<BulkPool> m_pool;
+    int m_bulkSize;
+    std::size_t m_maxBytes;
+    ParsingState m_state;
+    int m_depthCounter;
+    std::size_t m_carried;
+    std::unique_ptr<Bulk> m_commands;
+    CommandDictionary *m_dictionary = nullptr;
+};
+
+//totals of one parser, a server shares one set between all of its connections
+struct ParserCounters
+{
+    LiveCounter lines;
+    LiveCounter blocks;
+    LiveCounter commands;
+};
+
+//Sinks... get every bulk straight from publish, in template order and before the runtime subscribers
+//a sink is any type with push_back(const BulkPtr&), see IBulkHandler for the contract
+template<typename... Sinks>
+class BasicParser
+{
+    using ParsingState = BulkAssembler::ParsingState;
+
+    //net effect of a chunk on the brace depth: depth d at its start becomes sum + max(d, -minPrefix)
+    //a '}' at depth 0 is a plain command, so the walk is clamped at zero
+    struct DepthSummary
+    {
+        long sum = 0;
+        long minPrefix = 0;
+
+        long apply(long depth) const { return sum + std::max(depth, -minPrefix); }
+    };
+
+    //effect of a chunk on the size of the open top-level bulk: c becomes reset ? count : (c + count) % bulkSize
+    struct CountSummary
+    {
+        bool reset = false;
+        std::size_t count = 0;
+    };
+
+    struct Chunk
+    {
+        const char *begin;
+        const char *end;
+        bool last; //only the final chunk may end with a line lacking its newline
+        DepthSummary depth;
+        long startDepth = 0;
+        CountSummary count;
+        std::size_t startCount = 0;
+
+        std::size_t lines = 0;
+        bool headClosed = false;         //the bulk open at the chunk start was finished inside it
+        std::unique_ptr<Bulk> head;      //commands that belong to the bulk open at the chunk start
+        std::vector<std::unique_ptr<Bulk> > complete;
+        std::unique_ptr<Bulk> tail;      //bulk still open at the chunk end
+        int endDepth = 0;
+    };
+
+public:
+    BasicParser (int bulkSize, std::size_t parseThreads = 0, std::size_t chunkBytes = 16 << 20,
+                 const FlushOptions &flush = FlushOptions())
+        : BasicParser(std::tuple<Sinks&...>(), bulkSize, parseThreads, chunkBytes, flush)
+    { }
+
+    //BasicParser<ScreenWriter, FileWriter> parser(std::tie(screen, file), bulkSize);
+    BasicParser (const std::tuple<Sinks&...> &sinks, int bulkSize, std::size_t parseThreads = 0,
+                 std::size_t chunkBytes = 16 << 20, const FlushOptions &flush = FlushOptions())
+        : m_sinks(sinks)
+        , m_pool(BulkPool::create())
+        , m_bulkSize(bulkSize)
+        , m_parseThreads(parseThreads ? parseThreads : std::max(1u, std::thread::hardware_concurrency()))
+        , m_chunkBytes(std::max<std::size_t>(chunkBytes, 1))
+        , m_flush(flush)
+        , m_assembler(m_pool, bulkSize, flush.maxBytes)
+        , m_pending(false)
+        , m_counters(&m_ownCounters)
+    { }
+
+    //reads stdin up to the end
+    void exec(InputMode mode = InputMode::Auto)
+    {
+        //chunk boundaries are worked out from command counts alone, early flushes need the sequential parser
+        bool parallel = mode == InputMode::Parallel && !m_flush.maxAge.count() && !m_flush.maxBytes;
+
+        switch (mode)
+        {
+        case InputMode::Stream:
+            if (m_flush.maxAge.count())
+            {
+                readInput(STDIN_FILENO); //getline would sleep through the deadline
+                break;
+            }
+            for(std::string line; std::getline(std::cin, line);)
+                processLine(line.data(), line.size());
+            break;
+        case InputMode::Read:
+            readInput(STDIN_FILENO);
+            break;
+        case InputMode::Auto:
+        case InputMode::Mmap:
+        case InputMode::Parallel:
+            if (!mapInput(STDIN_FILENO, parallel))
+                readInput(STDIN_FILENO);
+            break;
+        }
+
+        finish();
+    }
+
+    //takes input in arbitrary chunks, only a line split between two chunks is copied
+    void feed(const char *data, std::size_t size)
+    {
+        TRACE_SCOPE("feed", size);
+        const char *end = data + size;
+        if (!m_partial.empty())
+        {
+            const char *newline = static_cast<const char *>(std::memchr(data, '\n', size));
+            if (!newline)
+            {
+                m_partial.append(data, size);
+                return;
+            }
+            m_partial.append(data, newline);
+            processLine(m_partial.data(), m_partial.size());
+            m_partial.clear();
+            data = newline + 1;
+        }
+
+        while (data < end)
+        {
+            const char *newline = static_cast<const char *>(std::memchr(data, '\n', end - data));
+            if (!newline)
+            {
+                m_partial.assign(data, end);
+                return;
+            }
+            processLine(data, newline - data);
+            data = newline + 1;
+        }
+    }
+
+    //end of input: a last line without newline still counts, an unclosed block is dropped
+    void finish()
+    {
+        if (!m_partial.empty())
+        {
+            processLine(m_partial.data(), m_partial.size());
+            m_partial.clear();
+        }
+
+        if (m_assembler.state() == ParsingState::TopLevel)
+            route(m_assembler.commands());
+
+        m_assembler.restart(0, 0, nullptr);
+    }
+
+    void processLine(const char *line, std::size_t size)
+    {
+        ++m_counters->lines;
+        assemble(line, size);
+    }
+
+    //processLine for a line counted elsewhere, the server feeds merged top-level commands through it
+    void assemble(const char *line, std::size_t size)
+    {
+        m_assembler.processLine(line, size, [this](std::unique_ptr<Bulk> &commands) { route(commands); });
+
+        if (m_flush.maxAge.count() && !m_pending && m_assembler.state() == ParsingState::TopLevel
+                && !m_assembler.commands()->empty())
+        {
+            m_pending = true;
+            m_pendingSince = std::chrono::steady_clock::now();
+        }
+    }
+
+    //parses a mapped region on parseThreads threads, bulks reach the subscribers in input order
+    void parseParallel(const char *data, std::size_t size)
+    {
+        const char *end = data + size;
+
+        //rounds keep the bulks built ahead of publishing bounded
+        while (data < end)
+        {
+            std::vector<Chunk> chunks = split(data, end, m_chunkBytes);
+            data = chunks.back().end;
+
+            runChunks(chunks, [this](Chunk &chunk) { summarizeDepth(chunk); });
+            long depth = m_assembler.depth();
+            for (Chunk &chunk : chunks)
+            {
+                chunk.startDepth = depth;
+                depth = chunk.depth.apply(depth);
+            }
+
+            runChunks(chunks, [this](Chunk &chunk) { summarizeCount(chunk); });
+            std::size_t count = m_assembler.state() == ParsingState::TopLevel ? m_assembler.commands()->size() : 0;
+            for (Chunk &chunk : chunks)
+            {
+                chunk.startCount = count;
+                count = chunk.count.reset ? chunk.count.count : (count + chunk.count.count) % m_bulkSize;
+            }
+
+            runChunks(chunks, [this](Chunk &chunk) { buildChunk(chunk); });
+            stitch(chunks);
+        }
+    }
+
+    void subscribe(const std::function<void(const BulkPtr&)>& callback)
+    {
+        m_subscribers.push_back(callback);
+    }
+
+    //one virtual call per bulk instead of a std::function, the handler must outlive the parser
+    void subscribe(IBulkHandler &handler)
+    {
+        m_handlers.push_back(&handler);
+    }
+
+    //top-level bulks go to merge instead of the subscribers, blocks are still published as usual
+    void mergeStatic(const std::function<void(const Bulk&)>& merge)
+    {
+        m_merge = merge;
+    }
+
+    //milliseconds until the open top-level bulk is due for --flush-ms, -1 when nothing waits
+    //a bulk that is already due is published right away
+    int flushTimeout()
+    {
+        if (!m_pending)
+            return -1;
+
+        auto left = m_pendingSince + m_flush.maxAge - std::chrono::steady_clock::now();
+        if (left > left.zero())
+            return static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(left).count()) + 1;
+
+        route(m_assembler.commands());
+        return -1;
+    }
+
+    void publish(std::unique_ptr<Bulk> &commands)
+    {
+        if (commands->empty())
+            return;
+
+        TRACE_SCOPE("publish", commands->size());
+        m_counters->commands += commands->size();
+        ++m_counters->blocks;
+        m_pending = false;
+
+        commands->stamp(std::chrono::steady_clock::now());
+        commands->number(m_counters->blocks);
+        BulkPtr bulk = m_pool->share(std::move(commands));
+        commands = m_pool->acquire();
+
+        deliver(bulk, std::index_sequence_for<Sinks...>());
+        for (IBulkHandler *handler : m_handlers)
+            handler->push_back(bulk);
+        for (const auto& subscriber : m_subscribers)
+        {
+            subscriber(bulk);
+        }
+    }
+
+    //counts go to counters from now on, they must outlive the parser
+    //the blocks count is the bulk sequence, parsers counting into the same counters number their bulks together
+    void countInto(ParserCounters &counters)
+    {
+        m_counters = &counters;
+    }
+
+    //repeated commands are shared through dictionary from now on instead of being copied into every bulk
+    //only the sequential parser interns, the chunk threads of InputMode::Parallel copy as before
+    //dictionary must outlive the parser and every bulk it publishes
+    void intern(CommandDictionary &dictionary)
+    {
+        m_assembler.intern(&dictionary);
+    }
+
+    //readable from any thread while the parser runs
+    const ParserCounters &counters() const { return *m_counters; }
+
+    void printStats()
+    {
+        std::cout << std::this_thread::get_id() << " Lines " << m_counters->lines << std::endl;
+        std::cout << std::this_thread::get_id() << " Blocks " << m_counters->blocks << std::endl;
+        std::cout << std::this_thread::get_id() << " Commands " << m_counters->commands << std::endl;
+    }
+
+private:
+    template<std::size_t... I>
+    void deliver(const BulkPtr &bulk, std::index_sequence<I...>)
+    {
+        int expand[] = { 0, (std::get<I>(m_sinks).push_back(bulk), 0)... };
+        (void)expand;
+    }
+
+    void route(std::unique_ptr<Bulk> &commands)
+    {
+        if (m_merge && m_assembler.state() == ParsingState::TopLevel)
+        {
+            if (!commands->empty())
+                m_merge(*commands);
+            commands->clear();
+            m_pending = false;
+        }
+        else
+            publish(commands);
+    }
+
+    void readInput(int fd)
+    {
+        std::vector<char> buffer(1 << 20);
+        for (;;)
+        {
+            if (m_flush.maxAge.count() && !waitInput(fd))
+                continue;
+
+            ssize_t got = ::read(fd, buffer.data(), buffer.size());
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got <= 0)
+                break;
+            feed(buffer.data(), got);
+        }
+    }
+
+    //sleeps in poll(2) no longer than the open top-level bulk may wait, publishes it when its deadline passes first
+    bool waitInput(int fd)
+    {
+        pollfd event = { fd, POLLIN, 0 };
+        int ready = ::poll(&event, 1, flushTimeout());
+        return ready > 0 || (ready < 0 && errno != EINTR); //a poll error is left for read(2) to report
+    }
+
+    //regular files are parsed in place, lines go to the bulk arena straight from the page cache
+    bool mapInput(int fd, bool parallel)
+    {
+        struct stat info;
+        if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode))
+            return false;
+
+        off_t offset = ::lseek(fd, 0, SEEK_CUR);
+        if (offset < 0 || offset >= info.st_size)
+            return offset >= 0; //nothing left to read
+
+        void *mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED)
+            return false;
+        madvise(mapped, info.st_size, parallel ? MADV_WILLNEED : MADV_SEQUENTIAL);
+
+        const char *data = static_cast<const char *>(mapped) + offset;
+        std::size_t size = info.st_size - offset;
+        if (parallel && m_partial.empty())
+            parseParallel(data, size);
+        else
+            feed(data, size);
+
+        munmap(mapped, info.st_size);
+        ::lseek(fd, 0, SEEK_END);
+        return true;
+    }
+
+    template<typename Function>
+    static void forEachLine(const Chunk &chunk, Function &&function)
+    {
+        const char *data = chunk.begin;
+        while (data < chunk.end)
+        {
+            const char *newline = static_cast<const char *>(std::memchr(data, '\n', chunk.end - data));
+            if (!newline)
+            {
+                if (chunk.last)
+                    function(data, chunk.end - data);
+                return;
+            }
+            function(data, newline - data);
+            data = newline + 1;
+        }
+    }
+
+    //one round: up to parseThreads chunks of chunkBytes, every chunk ends right after a newline
+    std::vector<Chunk> split(const char *data, const char *end, std::size_t chunkBytes)
+    {
+        std::vector<Chunk> chunks;
+        for (std::size_t i = 0; i < m_parseThreads && data < end; ++i)
+        {
+            Chunk chunk;
+            chunk.begin = data;
+            chunk.end = end;
+            if (static_cast<std::size_t>(end - data) > chunkBytes)
+            {
+                const char *newline = static_cast<const char *>(std::memchr(data + chunkBytes, '\n', end - data - chunkBytes));
+                if (newline)
+                    chunk.end = newline + 1;
+            }
+            chunk.last = chunk.end == end;
+            data = chunk.end;
+            chunks.push_back(std::move(chunk));
+        }
+        return chunks;
+    }
+
+    template<typename Function>
+    static void runChunks(std::vector<Chunk> &chunks, Function function)
+    {
+        std::vector<std::thread> threads;
+        //chunk threads charge their allocations where the parser does
+        AllocSite site = currentAllocSite();
+        for (std::size_t i = 1; i < chunks.size(); ++i)
+        {
+            Chunk &chunk = chunks[i];
+            threads.emplace_back([&function, &chunk, site]
+            {
+                AllocScope scope(site);
+                function(chunk);
+            });
+        }
+        function(chunks[0]);
+        for (auto &thread : threads)
+            thread.join();
+    }
+
+    void summarizeDepth(Chunk &chunk)
+    {
+        long depth = 0;
+        forEachLine(chunk, [&](const char *line, std::size_t size)
+        {
+            if (BulkAssembler::isLine(line, size, '{'))
+                depth++;
+            else if (BulkAssembler::isLine(line, size, '}'))
+                depth--;
+            chunk.depth.minPrefix = std::min(chunk.depth.minPrefix, depth);
+        });
+        chunk.depth.sum = depth;
+    }
+
+    void summarizeCount(Chunk &chunk)
+    {
+        long depth = chunk.startDepth;
+        forEachLine(chunk, [&](const char *line, std::size_t size)
+        {
+            if (depth == 0)
+            {
+                if (BulkAssembler::isLine(line, size, '{'))
+                {
+                    depth = 1;
+                    chunk.count.reset = true;
+                    chunk.count.count = 0;
+                }
+                else
+                    chunk.count.count = (chunk.count.count + 1) % m_bulkSize;
+            }
+            else if (BulkAssembler::isLine(line, size, '{'))
+                depth++;
+            else if (BulkAssembler::isLine(line, size, '}') && --depth == 0)
+            {
+                chunk.count.reset = true;
+                chunk.count.count = 0;
+            }
+        });
+    }
+
+    void buildChunk(Chunk &chunk)
+    {
+        BulkAssembler assembler(m_pool, m_bulkSize);
+        assembler.restart(chunk.startDepth, chunk.startCount, nullptr);
+
+        auto collect = [&](std::unique_ptr<Bulk> &commands)
+        {
+            if (!chunk.headClosed)
+            {
+                chunk.headClosed = true;
+                chunk.head = std::move(commands);
+            }
+            else if (!commands->empty())
+                chunk.complete.push_back(std::move(commands));
+            else
+                return;
+            commands = m_pool->acquire();
+        };
+
+        forEachLine(chunk, [&](const char *line, std::size_t size)
+        {
+            chunk.lines++;
+            assembler.processLine(line, size, collect);
+        });
+
+        if (chunk.headClosed)
+            chunk.tail = std::move(assembler.commands());
+        else
+            chunk.head = std::move(assembler.commands());
+        chunk.endDepth = assembler.depth();
+    }
+
+    //sequential pass in input order: glue boundary pieces onto the open bulk and publish
+    void stitch(std::vector<Chunk> &chunks)
+    {
+        std::unique_ptr<Bulk> &open = m_assembler.commands();
+        for (Chunk &chunk : chunks)
+        {
+            m_counters->lines += chunk.lines;
+            open->append(*chunk.head);
+            if (!chunk.headClosed)
+                continue;
+
+            publish(open);
+            for (auto &commands : chunk.complete)
+                publish(commands);
+            open = std::move(chunk.tail);
+        }
+        m_assembler.restart(chunks.back().endDepth, 0, std::move(open));
+    }
+
+    std::tuple<Sinks&...> m_sinks;
+    std::vector<IBulkHandler *> m_handlers;
+    std::vector<std::function<void(const BulkPtr&)> > m_subscribers;
+    std::function<void(const Bulk&)> m_merge;
+    std::shared_ptr<BulkPool> m_pool;
+    int m_bulkSize;
+    std::size_t m_parseThreads;
+    std::size_t m_chunkBytes;
+    FlushOptions m_flush;
+
+    BulkAssembler m_assembler;
+    std::string m_partial; //line carried over between feed calls
+    bool m_pending; //the open top-level bulk has a command waiting since m_pendingSince
+    std::chrono::steady_clock::time_point m_pendingSince;
+
+    ParserCounters m_ownCounters;
+    ParserCounters *m_counters;
+};
+
+using Parser = BasicParser<>;
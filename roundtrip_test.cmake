@@ -0,0 +1,60 @@
+#проверка ctest: bulkmt пишет поток с пустыми строками и повторами команд, bulkmt_decode читает все .bin обратно
+#cmake -DBULKMT=... -DDECODE=... -DWORK_DIR=... -DLINES=N [-DARGS="--intern;8"] -P roundtrip_test.cmake
+foreach(name BULKMT DECODE WORK_DIR LINES)
+  if(NOT DEFINED ${name})
+    message(FATAL_ERROR "${name} is not set")
+  endif()
+endforeach()
+
+file(REMOVE_RECURSE ${WORK_DIR})
+file(MAKE_DIRECTORY ${WORK_DIR})
+
+#первая строка пустая: пустая команда первой попадает в словарь; 61 разная команда повторяется по кругу
+set(stream "")
+math(EXPR last "${LINES} - 1")
+foreach(i RANGE 0 ${last})
+  math(EXPR empty "${i} % 7")
+  math(EXPR command "${i} * 37 % 61")
+  if(empty EQUAL 0)
+    set(stream "${stream}\n")
+  else()
+    set(stream "${stream}cmd${command}\n")
+  endif()
+endforeach()
+file(WRITE ${WORK_DIR}/input.txt "${stream}")
+
+execute_process(COMMAND ${BULKMT} 2 --quiet-paths ${ARGS}
+  INPUT_FILE ${WORK_DIR}/input.txt
+  OUTPUT_VARIABLE output
+  RESULT_VARIABLE result
+  WORKING_DIRECTORY ${WORK_DIR})
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "bulkmt exited with ${result}")
+endif()
+string(REGEX MATCH "MAIN\n[0-9]+ Lines [0-9]+\n[0-9]+ Blocks [0-9]+\n[0-9]+ Commands ([0-9]+)" main "${output}")
+if(NOT main)
+  message(FATAL_ERROR "no parser counters in the output:\n${output}")
+endif()
+set(parsed ${CMAKE_MATCH_1})
+
+#каждый файл должен читаться сам по себе, а вместе они - вернуть все команды
+file(GLOB logs ${WORK_DIR}/*.bin)
+if(logs)
+  execute_process(COMMAND ${DECODE} --check ${logs}
+    OUTPUT_VARIABLE checked
+    ERROR_VARIABLE errors
+    RESULT_VARIABLE result)
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "bulkmt_decode rejects the logs:\n${errors}")
+  endif()
+  set(decoded 0)
+  string(REGEX MATCHALL "[0-9]+ commands" counts "${checked}")
+  foreach(count IN LISTS counts)
+    string(REGEX REPLACE " commands" "" count "${count}")
+    math(EXPR decoded "${decoded} + ${count}")
+  endforeach()
+  if(NOT decoded EQUAL parsed)
+    message(FATAL_ERROR "${parsed} commands parsed, ${decoded} decoded")
+  endif()
+endif()
+file(REMOVE_RECURSE ${WORK_DIR})
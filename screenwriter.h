@@ -0,0 +1,166 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+#include "handler.h"
+#include "iopipe.h"
+
+struct ScreenOptions
+{
+    bool batched = false; //format a whole drained batch into one buffer and emit it with a single write(2)
+    std::chrono::milliseconds flushInterval{0}; //batched mode holds output up to this long, 0 flushes every batch
+    std::size_t maxBuffer = 256 * 1024; //flush early once this much is buffered
+    CpuSet cpus; //where the screen worker may run, empty leaves it to the scheduler
+    bool pipelined = false; //batched, and the worker only formats: an I/O thread of its own writes the buffers
+};
+
+//Queue picks the worker queue: SpscQueue for the single parser thread, MpscQueue when several threads publish
+template<template<typename> class Queue = SpscQueue>
+class BasicScreenWriter final : public IBulkHandler
+{
+public:
+
+    //with an executor the screen is one ordered lane of it, the executor has to outlive the writer
+    BasicScreenWriter(std::size_t capacity = 1024, OverflowPolicy policy = OverflowPolicy::Block,
+                 const ScreenOptions &options = ScreenOptions(), Executor *executor = nullptr)
+        : m_options(options)
+        , m_lastFlush(std::chrono::steady_clock::now())
+        , m_pipe(options.pipelined ? new IoPipe() : nullptr)
+        , m_worker(std::bind(&BasicScreenWriter::write, this, std::placeholders::_1), capacity, policy, makeHooks(options), true,
+                   executor)
+    {
+        if (m_pipe)
+            m_pipe->open(8, 64 * 1024);
+        registerWorker(&m_worker);
+    }
+
+    void push_back(const BulkPtr &commands)
+    {
+        m_worker.push_back(commands);
+    }
+
+    void close(std::chrono::steady_clock::time_point deadline)
+    {
+        m_worker.close(deadline);
+    }
+
+    void stop()
+    {
+        m_worker.stop();
+        flush(true); //the worker thread is gone, whatever the flush interval held back goes out now
+        if (m_pipe)
+            m_pipe->drain();
+    }
+
+    std::vector<BulkPtr> undrained()
+    {
+        return m_worker.takeUndrained();
+    }
+
+    void write(const BulkPtr &commands)
+    {
+        AllocScope scope(AllocSite::Screen);
+        if (m_options.batched || m_pipe)
+        {
+            if (m_prefix.empty())
+            {
+                std::ostringstream id;
+                id << std::this_thread::get_id() << " ";
+                m_prefix = id.str();
+            }
+            m_buffer.append(m_prefix);
+            appendBulkText(m_buffer, *commands);
+            return;
+        }
+
+        std::cout << std::this_thread::get_id() << " " << "bulk:";
+        for (const auto &command : *commands)
+            std::cout << command << " ";
+        std::cout << std::endl;
+    }
+
+private:
+    WorkerHooks<BulkPtr> makeHooks(const ScreenOptions &options)
+    {
+        WorkerHooks<BulkPtr> hooks;
+        if (!options.cpus.empty())
+        {
+            CpuSet cpus = options.cpus;
+            hooks.started = [cpus]
+            {
+                if (!cpus.pin())
+                    std::cerr << "cannot pin the screen worker" << std::endl;
+            };
+        }
+        if (options.batched || options.pipelined)
+        {
+            hooks.batchDone = std::bind(&BasicScreenWriter::flush, this, false);
+            hooks.idle = std::bind(&BasicScreenWriter::flush, this, false);
+            hooks.idleInterval = options.flushInterval;
+        }
+        return hooks;
+    }
+
+    void flush(bool force)
+    {
+        if (m_buffer.empty())
+            return;
+
+        AllocScope scope(AllocSite::Screen);
+        auto now = std::chrono::steady_clock::now();
+        if (!force && m_buffer.size() < m_options.maxBuffer && now - m_lastFlush < m_options.flushInterval)
+            return;
+
+        std::cout.flush(); //keep anything already sent through std::cout in front of us
+        if (m_pipe)
+        {
+            //the bytes move into slots of the I/O thread, the buffer is free for the next batch right away
+            for (std::size_t done = 0; done < m_buffer.size();)
+            {
+                unsigned slot = m_pipe->acquire();
+                std::size_t part = std::min(m_buffer.size() - done, m_pipe->slotSize());
+                std::memcpy(m_pipe->slot(slot), m_buffer.data() + done, part);
+                m_pipe->write(STDOUT_FILENO, slot, part, IoPipe::CurrentOffset);
+                done += part;
+            }
+            m_buffer.clear();
+            m_lastFlush = now;
+            return;
+        }
+
+        const char *data = m_buffer.data();
+        std::size_t size = m_buffer.size();
+        while (size > 0)
+        {
+            ssize_t written = ::write(STDOUT_FILENO, data, size);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            data += written;
+            size -= written;
+        }
+        m_buffer.clear();
+        m_lastFlush = now;
+    }
+
+    ScreenOptions m_options;
+    std::string m_buffer; //reused between batches
+    std::string m_prefix; //"<thread id> ", computed once on the worker thread or the first pool thread
+    std::chrono::steady_clock::time_point m_lastFlush;
+    std::unique_ptr<IoPipe> m_pipe; //pipelined only, outlives the worker that feeds it
+    Worker<BulkPtr, Queue> m_worker; //declared last so it stops first
+};
+
+using ScreenWriter = BasicScreenWriter<>;
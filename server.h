@@ -0,0 +1,380 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "parser.h"
+
+//listening sockets are non-blocking, a unix socket path is replaced if it exists
+inline int listenUnix(const std::string &path)
+{
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    if (path.empty() || path.size() >= sizeof(address.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, path.c_str(), path.size());
+
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    ::unlink(path.c_str());
+    if (::bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || ::listen(fd, SOMAXCONN) != 0)
+    {
+        int saved = errno;
+        ::close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+inline int listenTcp(std::string address)
+{
+    if (address.compare(0, 4, "tcp:") == 0)
+        address = address.substr(4);
+
+    std::string host;
+    std::string port = address;
+    std::size_t colon = address.rfind(':');
+    if (colon != std::string::npos)
+    {
+        host = address.substr(0, colon);
+        port = address.substr(colon + 1);
+    }
+    if (host.size() > 1 && host.front() == '[' && host.back() == ']')
+        host = host.substr(1, host.size() - 2);
+
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo *found = nullptr;
+    if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &found) != 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int fd = -1;
+    for (addrinfo *info = found; info && fd < 0; info = info->ai_next)
+    {
+        fd = ::socket(info->ai_family, info->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, info->ai_protocol);
+        if (fd < 0)
+            continue;
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (::bind(fd, info->ai_addr, info->ai_addrlen) != 0 || ::listen(fd, SOMAXCONN) != 0)
+        {
+            int saved = errno;
+            ::close(fd);
+            errno = saved;
+            fd = -1;
+        }
+    }
+    freeaddrinfo(found);
+    return fd;
+}
+
+//unix:PATH, tcp:HOST:PORT, HOST:PORT or PORT
+inline int openListener(const std::string &address)
+{
+    return address.compare(0, 5, "unix:") == 0 ? listenUnix(address.substr(5)) : listenTcp(address);
+}
+
+//accepts any number of TCP/unix stream connections on one epoll(7) thread
+//every connection has its own Parser, so bulk accumulation and {} nesting stay per connection
+//with mergeStatic the top-level commands of all connections are collected into shared static bulks
+class BulkServer
+{
+    struct Connection
+    {
+        int fd;
+        std::unique_ptr<Parser> parser;
+    };
+
+public:
+    BulkServer(int bulkSize, bool mergeStatic = false, const FlushOptions &flush = FlushOptions())
+        : m_bulkSize(bulkSize)
+        , m_flush(flush)
+        , m_epoll(epoll_create1(EPOLL_CLOEXEC))
+    {
+        if (mergeStatic)
+        {
+            m_static.reset(new Parser(bulkSize, 1, 16 << 20, flush));
+            m_static->countInto(m_counters);
+        }
+    }
+
+    ~BulkServer()
+    {
+        for (int fd : m_listeners)
+            ::close(fd);
+        for (auto &connection : m_connections)
+            ::close(connection.first);
+        for (const std::string &path : m_socketPaths)
+            ::unlink(path.c_str());
+        if (m_epoll >= 0)
+            ::close(m_epoll);
+    }
+
+    //unix:PATH, tcp:HOST:PORT, HOST:PORT or PORT
+    bool listen(const std::string &address)
+    {
+        int fd = openListener(address);
+        if (fd < 0)
+        {
+            std::cerr << "can not listen on " << address << ": " << std::strerror(errno) << std::endl;
+            return false;
+        }
+
+        if (address.compare(0, 5, "unix:") == 0)
+            m_socketPaths.push_back(address.substr(5));
+        m_listeners.push_back(fd);
+        return watch(fd);
+    }
+
+    void subscribe(const std::function<void(const BulkPtr&)>& callback)
+    {
+        m_subscribers.push_back(callback);
+        if (m_static)
+            m_static->subscribe(callback);
+    }
+
+    void subscribe(IBulkHandler &handler)
+    {
+        m_handlers.push_back(&handler);
+        if (m_static)
+            m_static->subscribe(handler);
+    }
+
+    //SIGINT and SIGTERM are blocked in the calling thread and in every thread it starts from now on
+    //call it before the sinks start their threads, run() then is the only one to see the signals
+    static void blockSignals()
+    {
+        sigset_t signals = stopSignals();
+        ::pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    }
+
+    //serves connections until SIGINT or SIGTERM, then parses what is already buffered and returns
+    //the signals are read from a signalfd in the epoll set, so no blocking call of another thread sees EINTR
+    void run()
+    {
+        blockSignals();
+        sigset_t signals = stopSignals();
+        int stop = ::signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (m_epoll < 0 || stop < 0)
+        {
+            if (stop >= 0)
+                ::close(stop);
+            return;
+        }
+        watch(stop);
+
+        std::vector<char> buffer(64 * 1024);
+        epoll_event events[64];
+        for (bool running = true; running;)
+        {
+            int ready = epoll_wait(m_epoll, events, 64, flushTimeout());
+            for (int i = 0; i < ready; ++i)
+            {
+                int fd = events[i].data.fd;
+                if (fd == stop)
+                {
+                    signalfd_siginfo info;
+                    running = ::read(stop, &info, sizeof(info)) != static_cast<ssize_t>(sizeof(info));
+                }
+                else if (std::find(m_listeners.begin(), m_listeners.end(), fd) != m_listeners.end())
+                    accept(fd);
+                else if (!receive(fd, buffer, false))
+                    disconnect(fd);
+            }
+        }
+
+        //a second signal while the buffered input is parsed stops the process as it did before run
+        ::close(stop);
+        ::pthread_sigmask(SIG_UNBLOCK, &signals, nullptr);
+
+        while (!m_connections.empty())
+        {
+            int fd = m_connections.begin()->first;
+            receive(fd, buffer, true);
+            disconnect(fd);
+        }
+        if (m_static)
+            m_static->finish();
+    }
+
+    void printStats()
+    {
+        std::cout << std::this_thread::get_id() << " Connections " << m_accepted << std::endl;
+        std::cout << std::this_thread::get_id() << " Lines " << m_counters.lines << std::endl;
+        std::cout << std::this_thread::get_id() << " Blocks " << m_counters.blocks << std::endl;
+        std::cout << std::this_thread::get_id() << " Commands " << m_counters.commands << std::endl;
+    }
+
+    //every connection parser interns into dictionary, connections opened before this call included
+    void intern(CommandDictionary &dictionary)
+    {
+        m_dictionary = &dictionary;
+        if (m_static)
+            m_static->intern(dictionary);
+        for (auto &connection : m_connections)
+            connection.second.parser->intern(dictionary);
+    }
+
+    //totals over all connections, closed or open, readable from any thread
+    const ParserCounters &counters() const { return m_counters; }
+    std::uint64_t acceptedCount() const { return m_accepted; }
+    std::size_t connectionCount() const { return m_connectionCount.load(std::memory_order_relaxed); }
+
+private:
+    static sigset_t stopSignals()
+    {
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        return signals;
+    }
+
+    bool watch(int fd)
+    {
+        epoll_event event;
+        std::memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        return epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &event) == 0;
+    }
+
+    void accept(int listener)
+    {
+        for (;;)
+        {
+            int fd = ::accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    std::cerr << "accept failed: " << std::strerror(errno) << std::endl;
+                return;
+            }
+
+            Connection connection;
+            connection.fd = fd;
+            if (m_static)
+            {
+                //top-level commands are handed over one by one, the shared parser cuts the static bulks
+                connection.parser.reset(new Parser(1, 1));
+                Parser *merged = m_static.get();
+                connection.parser->mergeStatic([merged](const Bulk &commands)
+                {
+                    for (const CommandRef &command : commands)
+                        merged->assemble(command.data(), command.size());
+                });
+            }
+            else
+                connection.parser.reset(new Parser(m_bulkSize, 1, 16 << 20, m_flush));
+            connection.parser->countInto(m_counters);
+            if (m_dictionary)
+                connection.parser->intern(*m_dictionary);
+            for (IBulkHandler *handler : m_handlers)
+                connection.parser->subscribe(*handler);
+            for (const auto &subscriber : m_subscribers)
+                connection.parser->subscribe(subscriber);
+
+            if (!watch(fd))
+            {
+                ::close(fd);
+                continue;
+            }
+            m_connections.emplace(fd, std::move(connection));
+            ++m_accepted;
+            m_connectionCount.store(m_connections.size(), std::memory_order_relaxed);
+        }
+    }
+
+    //false once the peer is gone, drain keeps reading until the socket has nothing more buffered
+    bool receive(int fd, std::vector<char> &buffer, bool drain)
+    {
+        Parser &parser = *m_connections.at(fd).parser;
+        do
+        {
+            ssize_t got = ::read(fd, buffer.data(), buffer.size());
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return true;
+            if (got <= 0)
+                return false;
+            parser.feed(buffer.data(), got);
+        } while (drain);
+        return true;
+    }
+
+    //the last line and the top-level bulk are published, an unclosed block is dropped as at the end of stdin
+    void disconnect(int fd)
+    {
+        auto found = m_connections.find(fd);
+        Parser &parser = *found->second.parser;
+        parser.finish();
+
+        epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, nullptr);
+        ::close(fd);
+        m_connections.erase(found);
+        m_connectionCount.store(m_connections.size(), std::memory_order_relaxed);
+    }
+
+    //the nearest --flush-ms deadline over the shared static bulk and every connection
+    int flushTimeout()
+    {
+        int timeout = m_static ? m_static->flushTimeout() : -1;
+        if (!m_flush.maxAge.count() || m_static)
+            return timeout;
+
+        for (auto &connection : m_connections)
+        {
+            int left = connection.second.parser->flushTimeout();
+            if (left >= 0 && (timeout < 0 || left < timeout))
+                timeout = left;
+        }
+        return timeout;
+    }
+
+    int m_bulkSize;
+    FlushOptions m_flush;
+    int m_epoll;
+    std::vector<int> m_listeners;
+    std::vector<std::string> m_socketPaths;
+    std::map<int, Connection> m_connections;
+    std::unique_ptr<Parser> m_static; //shared top-level bulk when connections are merged
+    std::vector<IBulkHandler *> m_handlers;
+    std::vector<std::function<void(const BulkPtr&)> > m_subscribers;
+
+    LiveCounter m_accepted;
+    std::atomic<std::size_t> m_connectionCount{0}; //open connections
+    ParserCounters m_counters;
+    CommandDictionary *m_dictionary = nullptr; //all connections run on one thread, so they can share it
+};
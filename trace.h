@@ -0,0 +1,201 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+//trace points on the hot path: feed, publish, enqueue, dequeue and write
+//they are compiled in with -DBULKMT_TRACE (cmake -DBULKMT_TRACE=ON), without it TRACE_SCOPE and
+//TRACE_INSTANT expand to nothing and their arguments are not evaluated
+//every thread records into its own ring without locks, only the newest TraceRing::Size events of a
+//thread survive; writeTrace dumps them as Chrome trace JSON (chrome://tracing, ui.perfetto.dev)
+
+#ifdef BULKMT_TRACE
+#define BULKMT_TRACE_JOIN2(a, b) a##b
+#define BULKMT_TRACE_JOIN(a, b) BULKMT_TRACE_JOIN2(a, b)
+#define TRACE_SCOPE(name, arg) TraceScope BULKMT_TRACE_JOIN(traceScope, __LINE__)(name, arg)
+#define TRACE_INSTANT(name, arg) Tracer::local().record(name, 'i', arg)
+#else
+#define TRACE_SCOPE(name, arg) do { } while (0)
+#define TRACE_INSTANT(name, arg) do { } while (0)
+#endif
+
+constexpr bool traceEnabled()
+{
+#ifdef BULKMT_TRACE
+    return true;
+#else
+    return false;
+#endif
+}
+
+//the time stamp counter where there is one, it is converted to time only when the trace is written
+inline std::uint64_t traceTicks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+struct TraceEvent
+{
+    const char *name; //string literals only, the ring keeps the pointer
+    std::uint64_t ticks;
+    std::uint64_t arg;
+    char phase;       //'B', 'E' or 'i' as in the trace event format
+};
+
+//written by its own thread only
+class TraceRing
+{
+public:
+    static const std::size_t Size = 1 << 14;
+
+    explicit TraceRing(std::size_t thread)
+        : m_events(new TraceEvent[Size])
+        , m_thread(thread)
+    { }
+
+    void record(const char *name, char phase, std::uint64_t arg)
+    {
+        TraceEvent &event = m_events[m_count++ & (Size - 1)];
+        event.name = name;
+        event.ticks = traceTicks();
+        event.arg = arg;
+        event.phase = phase;
+    }
+
+    std::size_t thread() const { return m_thread; }
+    std::uint64_t count() const { return m_count; }
+
+    //i-th of the surviving events, oldest first
+    const TraceEvent &event(std::size_t i) const
+    {
+        std::uint64_t first = m_count > Size ? m_count - Size : 0;
+        return m_events[(first + i) & (Size - 1)];
+    }
+
+    std::size_t size() const { return m_count > Size ? Size : static_cast<std::size_t>(m_count); }
+
+private:
+    std::unique_ptr<TraceEvent[]> m_events;
+    std::uint64_t m_count = 0;
+    std::size_t m_thread;
+};
+
+//owns the rings of every thread that ever hit a trace point, rings outlive their threads
+class Tracer
+{
+public:
+    static Tracer &instance()
+    {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    //the ring of the calling thread, the lock is taken once per thread
+    static TraceRing &local()
+    {
+        thread_local TraceRing *ring = instance().attach();
+        return *ring;
+    }
+
+    //call it once the traced threads are stopped, the rings are read without synchronisation
+    bool write(const std::string &path)
+    {
+        std::ofstream out(path);
+        if (!out)
+            return false;
+
+        //ticks are mapped to microseconds by the rate seen since the tracer was created
+        std::uint64_t ticks = traceTicks() - m_startTicks;
+        double nanoseconds = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - m_start).count();
+        double ticksPerMicrosecond = nanoseconds > 0 && ticks != 0 ? ticks / nanoseconds * 1000 : 1000;
+
+        std::lock_guard<std::mutex> lk(m_mutex);
+        out << "{\"traceEvents\":[";
+        const char *separator = "\n";
+        for (const auto &ring : m_rings)
+        {
+            out << separator << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << ::getpid() << ",\"tid\":"
+                << ring->thread() << ",\"args\":{\"name\":\"thread " << ring->thread() << "\"}}";
+            separator = ",\n";
+
+            int depth = 0;
+            for (std::size_t i = 0; i < ring->size(); ++i)
+            {
+                const TraceEvent &event = ring->event(i);
+                //a wrapped ring may start inside a scope, its end has no begin left
+                if (event.phase == 'E' && depth == 0)
+                    continue;
+                depth += event.phase == 'B' ? 1 : event.phase == 'E' ? -1 : 0;
+
+                double ts = (event.ticks - m_startTicks) / ticksPerMicrosecond;
+                out << separator << "{\"name\":\"" << event.name << "\",\"ph\":\"" << event.phase << "\",\"pid\":"
+                    << ::getpid() << ",\"tid\":" << ring->thread() << ",\"ts\":" << std::fixed << ts;
+                if (event.phase == 'i')
+                    out << ",\"s\":\"t\"";
+                out << ",\"args\":{\"n\":" << event.arg << "}}";
+            }
+        }
+        out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+        return static_cast<bool>(out);
+    }
+
+private:
+    Tracer()
+        : m_startTicks(traceTicks())
+        , m_start(std::chrono::steady_clock::now())
+    { }
+
+    TraceRing *attach()
+    {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        m_rings.emplace_back(new TraceRing(m_rings.size()));
+        return m_rings.back().get();
+    }
+
+    std::mutex m_mutex;
+    std::vector<std::unique_ptr<TraceRing> > m_rings;
+    std::uint64_t m_startTicks;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+//a begin event now and the matching end when the scope is left
+class TraceScope
+{
+public:
+    TraceScope(const char *name, std::uint64_t arg)
+        : m_ring(Tracer::local())
+        , m_name(name)
+    {
+        m_ring.record(name, 'B', arg);
+    }
+
+    ~TraceScope()
+    {
+        m_ring.record(m_name, 'E', 0);
+    }
+
+private:
+    TraceRing &m_ring;
+    const char *m_name;
+};
+
+//writes the Chrome trace of a traced build, false when tracing is compiled out or the file fails
+inline bool writeTrace(const std::string &path)
+{
+    return traceEnabled() && Tracer::instance().write(path);
+}
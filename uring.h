@@ -0,0 +1,348 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "asyncio.h"
+
+//io_uring on raw syscalls, no liburing needed; owned and used by a single thread
+//writes are queued into the submission ring and submit() hands the whole batch to the kernel with one
+//io_uring_enter, their buffers are slots of one arena registered with the kernel up front
+//write offsets are explicit, so writes to one file may complete in any order
+class IoRing : public AsyncIo
+{
+    struct Slot
+    {
+        int fd;
+        std::uint64_t offset;
+        std::size_t size;
+        std::size_t written;
+    };
+
+    struct FileState
+    {
+        unsigned inflight;
+        bool syncing; //an fdatasync follows the writes in flight
+        bool closing;
+    };
+
+    static const std::uint64_t SyncTag = 1ull << 63; //user_data of an fdatasync is the tagged descriptor
+
+public:
+    IoRing() = default;
+
+    IoRing(const IoRing &) = delete;
+    IoRing &operator=(const IoRing &) = delete;
+
+    ~IoRing()
+    {
+        drain();
+        if (m_sqes)
+            ::munmap(m_sqes, m_sqesBytes);
+        if (m_cqRing && m_cqRing != m_sqRing)
+            ::munmap(m_cqRing, m_cqBytes);
+        if (m_sqRing)
+            ::munmap(m_sqRing, m_sqBytes);
+        if (m_fd >= 0)
+            ::close(m_fd);
+    }
+
+    //false when the kernel has no io_uring or it is forbidden, errno tells why
+    bool open(unsigned entries, std::size_t slotCount, std::size_t slotSize)
+    {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        m_fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+        if (m_fd < 0)
+            return false;
+
+        m_sqBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        m_cqBytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            m_sqBytes = m_cqBytes = std::max(m_sqBytes, m_cqBytes);
+
+        m_sqRing = map(m_sqBytes, IORING_OFF_SQ_RING);
+        m_cqRing = params.features & IORING_FEAT_SINGLE_MMAP ? m_sqRing : map(m_cqBytes, IORING_OFF_CQ_RING);
+        m_sqesBytes = params.sq_entries * sizeof(io_uring_sqe);
+        void *sqes = map(m_sqesBytes, IORING_OFF_SQES);
+        if (!m_sqRing || !m_cqRing || !sqes)
+            return false;
+        m_sqes = static_cast<io_uring_sqe *>(sqes);
+
+        char *sq = static_cast<char *>(m_sqRing);
+        m_sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        m_sqMask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        m_sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        m_sqEntries = params.sq_entries;
+
+        char *cq = static_cast<char *>(m_cqRing);
+        m_cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        m_cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        m_cqMask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        m_cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+        m_slotSize = slotSize;
+        m_arena.reset(new char[slotCount * slotSize]);
+        m_slots.resize(slotCount);
+        std::vector<iovec> buffers(slotCount);
+        for (std::size_t i = 0; i < slotCount; ++i)
+        {
+            buffers[i].iov_base = m_arena.get() + i * slotSize;
+            buffers[i].iov_len = slotSize;
+            m_free.push_back(static_cast<unsigned>(slotCount - 1 - i));
+        }
+
+        //locked memory may be limited, plain writes from the same arena work as well
+        m_registered = ::syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_BUFFERS, buffers.data(),
+                                 static_cast<unsigned>(slotCount)) == 0;
+        return true;
+    }
+
+    std::size_t slotSize() const { return m_slotSize; }
+    char *slot(unsigned index) { return m_arena.get() + index * m_slotSize; }
+    bool registered() const { return m_registered; }
+    std::uint64_t errorCount() const { return m_errors; }
+
+    unsigned acquire()
+    {
+        while (m_free.empty())
+            enter(1);
+        unsigned index = m_free.back();
+        m_free.pop_back();
+        return index;
+    }
+
+    void release(unsigned index)
+    {
+        m_free.push_back(index);
+    }
+
+    void write(int fd, unsigned index, std::size_t size, std::uint64_t offset)
+    {
+        m_slots[index] = Slot{ fd, offset, size, 0 };
+        ++m_files[fd].inflight;
+        queue(index);
+    }
+
+    //several files are synced in one submission
+    void sync(int fd)
+    {
+        auto file = m_files.find(fd);
+        if (file == m_files.end())
+        {
+            m_files[fd].inflight = 1;
+            queueSync(fd);
+        }
+        else
+            file->second.syncing = true;
+    }
+
+    void closeWhenDone(int fd)
+    {
+        auto file = m_files.find(fd);
+        if (file == m_files.end())
+            ::close(fd);
+        else
+            file->second.closing = true;
+    }
+
+    //hands the queued writes to the kernel and collects what has completed, does not wait
+    void submit()
+    {
+        enter(0);
+    }
+
+    void drain()
+    {
+        while (m_inflight != 0)
+            enter(1);
+    }
+
+private:
+    void *map(std::size_t bytes, off_t offset)
+    {
+        void *p = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, offset);
+        return p == MAP_FAILED ? nullptr : p;
+    }
+
+    void queue(unsigned index)
+    {
+        while (m_queued == m_sqEntries)
+            enter(0);
+
+        const Slot &slot = m_slots[index];
+        unsigned tail = *m_sqTail;
+        io_uring_sqe *sqe = &m_sqes[tail & m_sqMask];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = m_registered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        sqe->fd = slot.fd;
+        sqe->off = slot.offset + slot.written;
+        sqe->addr = reinterpret_cast<std::uint64_t>(this->slot(index) + slot.written);
+        sqe->len = static_cast<unsigned>(slot.size - slot.written);
+        sqe->buf_index = static_cast<std::uint16_t>(index);
+        sqe->user_data = index;
+        m_sqArray[tail & m_sqMask] = tail & m_sqMask;
+        __atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+        ++m_queued;
+        ++m_inflight;
+    }
+
+    void queueSync(int fd)
+    {
+        while (m_queued == m_sqEntries)
+            enter(0);
+
+        unsigned tail = *m_sqTail;
+        io_uring_sqe *sqe = &m_sqes[tail & m_sqMask];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fd = fd;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe->user_data = SyncTag | static_cast<unsigned>(fd);
+        m_sqArray[tail & m_sqMask] = tail & m_sqMask;
+        __atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+        ++m_queued;
+        ++m_inflight;
+    }
+
+    //submits everything queued, waits for at least waitFor completions and reaps
+    void enter(unsigned waitFor)
+    {
+        if (m_queued != 0 || waitFor != 0)
+        {
+            long result = ::syscall(__NR_io_uring_enter, m_fd, m_queued, waitFor, waitFor ? IORING_ENTER_GETEVENTS : 0,
+                                    nullptr, 0);
+            if (result >= 0)
+                m_queued -= static_cast<unsigned>(result);
+            else if (errno != EINTR && errno != EBUSY && errno != EAGAIN)
+                abandon();
+        }
+        reap();
+    }
+
+    void reap()
+    {
+        unsigned head = *m_cqHead;
+        unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+        std::vector<unsigned> again;
+        std::vector<int> syncAgain;
+        for (; head != tail; ++head)
+        {
+            const io_uring_cqe &cqe = m_cqes[head & m_cqMask];
+            if (cqe.user_data & SyncTag)
+            {
+                int fd = static_cast<int>(cqe.user_data & ~SyncTag);
+                --m_inflight;
+                if (cqe.res == -EINTR || cqe.res == -EAGAIN)
+                    syncAgain.push_back(fd);
+                else
+                {
+                    m_errors += cqe.res < 0;
+                    finish(fd);
+                }
+                continue;
+            }
+
+            unsigned index = static_cast<unsigned>(cqe.user_data);
+            Slot &slot = m_slots[index];
+            --m_inflight;
+
+            if (cqe.res == -EINTR || cqe.res == -EAGAIN)
+                again.push_back(index);
+            else if (cqe.res <= 0)
+            {
+                ++m_errors;
+                complete(index);
+            }
+            else if ((slot.written += cqe.res) < slot.size)
+                again.push_back(index); //short write, the rest goes again
+            else
+                complete(index);
+        }
+        __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+
+        for (unsigned index : again)
+            queue(index);
+        for (int fd : syncAgain)
+            queueSync(fd);
+    }
+
+    void complete(unsigned index)
+    {
+        m_free.push_back(index);
+        finish(m_slots[index].fd);
+    }
+
+    //one operation on fd is over, the last one starts a requested sync or ends the descriptor
+    void finish(int fd)
+    {
+        auto file = m_files.find(fd);
+        if (--file->second.inflight != 0)
+            return;
+
+        if (file->second.syncing)
+        {
+            file->second.syncing = false;
+            file->second.inflight = 1;
+            queueSync(fd);
+            return;
+        }
+        if (file->second.closing)
+            ::close(fd);
+        m_files.erase(file);
+    }
+
+    //the ring itself failed, queued writes are lost but nothing waits on them forever
+    void abandon()
+    {
+        m_errors += m_inflight;
+        m_inflight = 0;
+        m_queued = 0;
+        for (auto &file : m_files)
+        {
+            if (file.second.closing)
+                ::close(file.first);
+        }
+        m_files.clear();
+        m_free.clear();
+        for (std::size_t i = 0; i < m_slots.size(); ++i)
+            m_free.push_back(static_cast<unsigned>(i));
+    }
+
+    int m_fd = -1;
+    void *m_sqRing = nullptr;
+    void *m_cqRing = nullptr;
+    io_uring_sqe *m_sqes = nullptr;
+    std::size_t m_sqBytes = 0;
+    std::size_t m_cqBytes = 0;
+    std::size_t m_sqesBytes = 0;
+    unsigned *m_sqTail = nullptr;
+    unsigned *m_sqArray = nullptr;
+    unsigned m_sqMask = 0;
+    unsigned m_sqEntries = 0;
+    unsigned *m_cqHead = nullptr;
+    unsigned *m_cqTail = nullptr;
+    io_uring_cqe *m_cqes = nullptr;
+    unsigned m_cqMask = 0;
+
+    unsigned m_queued = 0;   //in the submission ring, not yet seen by the kernel
+    unsigned m_inflight = 0; //queued or submitted, not yet completed
+    std::uint64_t m_errors = 0;
+    std::unique_ptr<char[]> m_arena;
+    std::size_t m_slotSize = 0;
+    std::vector<Slot> m_slots;
+    std::vector<unsigned> m_free;
+    bool m_registered = false;
+    std::unordered_map<int, FileState> m_files; //descriptors with writes in flight
+};
@@ -0,0 +1,865 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "affinity.h"
+#include "bulk.h"
+#include "executor.h"
+#include "trace.h"
+
+//default worker queue: unbounded, guarded by a mutex, consumer sleeps on a condition variable
+template<typename T>
+class MutexQueue
+{
+public:
+    explicit MutexQueue(std::size_t capacity = 0) : m_capacity(capacity) { }
+
+    //item is left untouched when the queue is full
+    bool try_push(T &&item)
+    {
+        {
+            std::lock_guard<std::mutex> lk(m_mutex);
+            if (m_capacity != 0 && m_items.size() >= m_capacity)
+                return false;
+            m_items.push_back(std::move(item));
+        }
+        m_condition.notify_one();
+        return true;
+    }
+
+    //waits for room in a bounded queue
+    void push(T &&item)
+    {
+        {
+            std::unique_lock<std::mutex> lk(m_mutex);
+            m_notFull.wait(lk, [&] { return m_capacity == 0 || m_items.size() < m_capacity || m_closed; });
+            m_items.push_back(std::move(item));
+        }
+        m_condition.notify_one();
+    }
+
+    bool try_pop(T &item)
+    {
+        {
+            std::lock_guard<std::mutex> lk(m_mutex);
+            if (m_items.empty())
+                return false;
+            item = std::move(m_items.front());
+            m_items.pop_front();
+        }
+        m_notFull.notify_one();
+        return true;
+    }
+
+    //blocks until something is queued or the queue is closed, moves everything queued into out
+    //returns false only when the queue is closed and fully drained
+    template<typename Container>
+    bool pop_all(Container &out)
+    {
+        {
+            std::unique_lock<std::mutex> lk(m_mutex);
+            m_condition.wait(lk, [&] { return !m_items.empty() || m_closed; });
+            if (m_items.empty())
+                return false;
+
+            for (auto &item : m_items)
+                out.push_back(std::move(item));
+            m_items.clear();
+        }
+        m_notFull.notify_all();
+        return true;
+    }
+
+    //same as pop_all but gives up after timeout, out stays empty and true is returned then
+    template<typename Container, typename Rep, typename Period>
+    bool pop_all_for(Container &out, const std::chrono::duration<Rep, Period> &timeout)
+    {
+        {
+            std::unique_lock<std::mutex> lk(m_mutex);
+            if (!m_condition.wait_for(lk, timeout, [&] { return !m_items.empty() || m_closed; }))
+                return true;
+            if (m_items.empty())
+                return false;
+
+            for (auto &item : m_items)
+                out.push_back(std::move(item));
+            m_items.clear();
+        }
+        m_notFull.notify_all();
+        return true;
+    }
+
+    void open()
+    {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        m_closed = false;
+    }
+
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lk(m_mutex);
+            m_closed = true;
+        }
+        m_condition.notify_all();
+        m_notFull.notify_all();
+    }
+
+    std::size_t size()
+    {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        return m_items.size();
+    }
+
+    std::size_t capacity() const { return m_capacity; }
+
+private:
+    std::deque<T> m_items;
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::condition_variable m_notFull;
+    std::size_t m_capacity;
+    bool m_closed = false;
+};
+
+//bounded lock-free ring (Vyukov), MultiProducer selects CAS on the enqueue side
+//consumer spins a little when the ring is empty and parks on a condition variable afterwards
+template<typename T, bool MultiProducer>
+class RingQueue
+{
+    struct Cell
+    {
+        std::atomic<std::size_t> sequence;
+        T data;
+    };
+
+    static const int SpinCount = 64;
+
+public:
+    explicit RingQueue(std::size_t capacity = 1024)
+        : m_capacity(roundCapacity(capacity ? capacity : 1024))
+        , m_mask(m_capacity - 1)
+        , m_cells(new Cell[m_capacity])
+        , m_enqueuePos(0)
+        , m_dequeuePos(0)
+    {
+        for (std::size_t i = 0; i < m_capacity; ++i)
+            m_cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    bool try_push(T &&item)
+    {
+        Cell *cell;
+        std::size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            cell = &m_cells[pos & m_mask];
+            std::size_t seq = cell->sequence.load(std::memory_order_acquire);
+            std::ptrdiff_t dif = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+            if (dif == 0)
+            {
+                if (!MultiProducer)
+                {
+                    m_enqueuePos.store(pos + 1, std::memory_order_relaxed);
+                    break;
+                }
+                if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (dif < 0)
+                return false; //full
+            else
+                pos = m_enqueuePos.load(std::memory_order_relaxed);
+        }
+
+        cell->data = std::move(item);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+
+        //pairs with the fence in pop_all, either we see the sleeper or it sees our item
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_sleeping.load(std::memory_order_relaxed))
+        {
+            std::lock_guard<std::mutex> lk(m_parkMutex);
+            m_parkCondition.notify_one();
+        }
+        return true;
+    }
+
+    void push(T &&item)
+    {
+        while (!try_push(std::move(item)))
+            std::this_thread::yield();
+    }
+
+    //safe from any thread, the dequeue side is multi-consumer
+    bool try_pop(T &item)
+    {
+        Cell *cell;
+        std::size_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            cell = &m_cells[pos & m_mask];
+            std::size_t seq = cell->sequence.load(std::memory_order_acquire);
+            std::ptrdiff_t dif = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos + 1);
+            if (dif == 0)
+            {
+                if (m_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (dif < 0)
+                return false; //empty
+            else
+                pos = m_dequeuePos.load(std::memory_order_relaxed);
+        }
+
+        item = std::move(cell->data);
+        cell->data = T();
+        cell->sequence.store(pos + m_mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    template<typename Container>
+    bool pop_all(Container &out)
+    {
+        while (pop_all_for(out, std::chrono::seconds(1)))
+        {
+            if (!out.empty())
+                return true;
+        }
+        return false;
+    }
+
+    template<typename Container, typename Rep, typename Period>
+    bool pop_all_for(Container &out, const std::chrono::duration<Rep, Period> &timeout)
+    {
+        for (int spin = 0; spin < SpinCount; ++spin)
+        {
+            if (drain(out))
+                return true;
+
+            if (m_closed.load(std::memory_order_acquire))
+                return drain(out);
+
+            std::this_thread::yield();
+        }
+
+        {
+            std::unique_lock<std::mutex> lk(m_parkMutex);
+            m_sleeping.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            m_parkCondition.wait_for(lk, timeout, [&] { return !empty() || m_closed.load(std::memory_order_acquire); });
+            m_sleeping.store(false, std::memory_order_relaxed);
+        }
+
+        if (drain(out))
+            return true;
+        if (m_closed.load(std::memory_order_acquire))
+            return drain(out);
+        return true; //timed out
+    }
+
+    void open()
+    {
+        m_closed.store(false, std::memory_order_release);
+    }
+
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lk(m_parkMutex);
+            m_closed.store(true, std::memory_order_release);
+        }
+        m_parkCondition.notify_all();
+    }
+
+    std::size_t size() const
+    {
+        std::size_t enqueued = m_enqueuePos.load(std::memory_order_relaxed);
+        std::size_t dequeued = m_dequeuePos.load(std::memory_order_relaxed);
+        return enqueued > dequeued ? enqueued - dequeued : 0;
+    }
+
+    bool empty() const
+    {
+        std::size_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+        return m_cells[pos & m_mask].sequence.load(std::memory_order_acquire) != pos + 1;
+    }
+
+    std::size_t capacity() const { return m_capacity; }
+
+private:
+    static std::size_t roundCapacity(std::size_t capacity)
+    {
+        std::size_t rounded = 2;
+        while (rounded < capacity)
+            rounded <<= 1;
+        return rounded;
+    }
+
+    template<typename Container>
+    bool drain(Container &out)
+    {
+        bool popped = false;
+        for (T item; try_pop(item); popped = true)
+            out.push_back(std::move(item));
+        return popped;
+    }
+
+    const std::size_t m_capacity;
+    const std::size_t m_mask;
+    std::unique_ptr<Cell[]> m_cells;
+    alignas(64) std::atomic<std::size_t> m_enqueuePos;
+    alignas(64) std::atomic<std::size_t> m_dequeuePos;
+    alignas(64) std::atomic<bool> m_sleeping{false};
+    std::atomic<bool> m_closed{false};
+    std::mutex m_parkMutex;
+    std::condition_variable m_parkCondition;
+};
+
+template<typename T> using SpscQueue = RingQueue<T, false>;
+template<typename T> using MpscQueue = RingQueue<T, true>;
+
+//counter written by one thread at a time and read by any, the update is a plain load and store
+class LiveCounter
+{
+public:
+    LiveCounter &operator+=(std::uint64_t value)
+    {
+        m_value.store(m_value.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+        return *this;
+    }
+
+    LiveCounter &operator++() { return *this += 1; }
+
+    operator std::uint64_t() const { return m_value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<std::uint64_t> m_value{0};
+};
+
+//live counters of one worker, readable from any thread while the worker exists
+//the producer and the consumer side sit on separate cache lines, each field has a single writer per line
+class WorkerStats
+{
+public:
+    //bucket 0 counts latencies under 1us, bucket i > 0 those in [2^(i-1), 2^i) us, the last one everything above
+    static constexpr std::size_t LatencyBuckets = 32;
+
+    //producer side: an item was queued and the queue now holds depth items
+    void accepted(std::size_t commands, std::size_t depth)
+    {
+        m_producer.blocks.fetch_add(1, std::memory_order_relaxed);
+        m_producer.commands.fetch_add(commands, std::memory_order_relaxed);
+        for (std::uint64_t high = m_producer.highWater.load(std::memory_order_relaxed);
+             depth > high && !m_producer.highWater.compare_exchange_weak(high, depth, std::memory_order_relaxed);)
+        { }
+    }
+
+    //consumer side: the worker function returned for an item published latency ago
+    void written(std::size_t commands, std::size_t bytes, std::chrono::nanoseconds latency)
+    {
+        ++m_consumer.blocks;
+        m_consumer.commands += commands;
+        m_consumer.bytes += bytes;
+        if (latency.count() >= 0)
+        {
+            ++m_latency[bucket(latency)];
+            m_consumer.latencySum += latency.count();
+        }
+    }
+
+    std::uint64_t acceptedBlocks() const { return m_producer.blocks.load(std::memory_order_relaxed); }
+    std::uint64_t acceptedCommands() const { return m_producer.commands.load(std::memory_order_relaxed); }
+    std::uint64_t highWater() const { return m_producer.highWater.load(std::memory_order_relaxed); }
+    std::uint64_t writtenBlocks() const { return m_consumer.blocks; }
+    std::uint64_t writtenCommands() const { return m_consumer.commands; }
+    std::uint64_t writtenBytes() const { return m_consumer.bytes; }
+    std::uint64_t latency(std::size_t bucket) const { return m_latency[bucket]; }
+    std::chrono::nanoseconds latencySum() const { return std::chrono::nanoseconds(m_consumer.latencySum); }
+
+    //upper bound of the bucket holding the given fraction of the recorded latencies, 0 before the first one
+    std::chrono::microseconds latencyPercentile(double fraction) const
+    {
+        std::uint64_t counts[LatencyBuckets];
+        for (std::size_t i = 0; i < LatencyBuckets; ++i)
+            counts[i] = latency(i);
+        return percentile(counts, fraction);
+    }
+
+    //same over a histogram summed up from several workers
+    static std::chrono::microseconds percentile(const std::uint64_t (&counts)[LatencyBuckets], double fraction)
+    {
+        std::uint64_t total = 0;
+        for (std::uint64_t count : counts)
+            total += count;
+        if (total == 0)
+            return std::chrono::microseconds(0);
+
+        std::uint64_t rank = std::min(static_cast<std::uint64_t>(fraction * total), total - 1);
+        std::uint64_t seen = 0;
+        std::size_t i = 0;
+        for (; i + 1 < LatencyBuckets; ++i)
+        {
+            seen += counts[i];
+            if (seen > rank)
+                break;
+        }
+        return std::chrono::microseconds(std::uint64_t(1) << i);
+    }
+
+private:
+    static std::size_t bucket(std::chrono::nanoseconds latency)
+    {
+        std::uint64_t us = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(latency).count());
+        std::size_t index = 0;
+        while (us != 0 && index + 1 < LatencyBuckets)
+        {
+            us >>= 1;
+            ++index;
+        }
+        return index;
+    }
+
+    //alignas(64) like the RingQueue positions, -faligned-new makes new honour it for heap allocated workers
+    struct alignas(64) Producer
+    {
+        std::atomic<std::uint64_t> blocks{0};
+        std::atomic<std::uint64_t> commands{0};
+        std::atomic<std::uint64_t> highWater{0};
+    };
+
+    //only the worker thread writes these, a thief counts what it stole in its own stats
+    struct alignas(64) Consumer
+    {
+        LiveCounter blocks;
+        LiveCounter commands;
+        LiveCounter bytes;
+        LiveCounter latencySum; //nanoseconds
+    };
+
+    Producer m_producer;
+    Consumer m_consumer;
+    LiveCounter m_latency[LatencyBuckets];
+};
+
+//type independent part of a worker, lets handlers keep stats for workers with different queues
+class IWorker
+{
+public:
+    virtual ~IWorker() { }
+    virtual const WorkerStats &stats() const = 0;
+    virtual std::thread::id getThreadId() = 0;
+    virtual std::size_t capacity() = 0; //0 means unbounded
+    virtual OverflowPolicy overflowPolicy() = 0;
+    virtual std::size_t overflowCount() = 0; //how many times the overflow policy fired
+    virtual std::size_t pending() = 0; //queued or in progress items
+    virtual std::size_t pendingBytes() = 0;
+    virtual std::size_t stolenCount() = 0; //items this worker took from its peers
+    virtual int cpu() = 0; //where the worker last ran a batch, -1 before the first one
+};
+
+//optional worker callbacks, all of them run on the worker thread
+template<typename T>
+struct WorkerHooks
+{
+    std::function<bool(T&)> steal;   //asked for a peer's item whenever the own queue runs empty
+    std::function<void()> batchDone; //after every drained batch, lets a sink flush once per batch
+    std::function<void()> idle;      //every idleInterval while nothing arrives
+    std::chrono::milliseconds idleInterval{0};
+    std::function<void()> started;   //first thing on a new worker thread, to pin it for instance; lanes never call it
+};
+
+//one consumer thread over one queue; the thread keeps this, so a worker never moves:
+//pools hold WorkerHandle, which stays valid while the pool container grows or shrinks
+//start and stop may be repeated, a restarted worker keeps its stats and spill file
+//with an executor the worker owns no thread, it is a lane run by the pool whenever its queue has items;
+//the steal hook is not used there, idle threads of the pool already pick up whichever lane has work
+template<typename T, template<typename> class Queue = MutexQueue>
+class Worker : public IWorker, public ExecutorTask
+{
+    static const std::size_t LaneBatch = 256; //items per lane run, then the lane goes behind its peers
+
+public:
+    //started unless autoStart is false, then nothing runs until start()
+    Worker(std::function<void(const T&)> workFunction, std::size_t capacity = 0, OverflowPolicy policy = OverflowPolicy::Block,
+           const WorkerHooks<T> &hooks = WorkerHooks<T>(), bool autoStart = true, Executor *executor = nullptr)
+        : m_workFunction(workFunction)
+        , m_hooks(hooks)
+        , m_executor(executor)
+        , m_queue(capacity)
+        , m_capacity(capacity)
+        , m_policy(policy)
+        , m_running(false)
+    {
+        if (autoStart)
+            start();
+    }
+
+    Worker(const Worker &) = delete;
+    Worker &operator=(const Worker &) = delete;
+
+    ~Worker()
+    {
+        stop();
+    }
+
+    void push_back(const T &commands)
+    {
+        TRACE_SCOPE("enqueue", payloadCount(commands));
+        T item(commands);
+        m_stats.accepted(payloadCount(item), ++m_pending);
+        m_pendingBytes += payloadBytes(item);
+
+        //while older items are on disk, newer ones follow them there to keep the order
+        if (m_policy == OverflowPolicy::Spill && m_spill.pending() != 0)
+        {
+            spill(item);
+            schedule();
+            return;
+        }
+
+        if (m_queue.try_push(std::move(item)))
+        {
+            schedule();
+            return;
+        }
+
+        switch (m_policy)
+        {
+        case OverflowPolicy::Block:
+            m_overflowCount++;
+            schedule(); //a full lane is scheduled already, unless its last run just ended
+            m_queue.push(std::move(item));
+            break;
+        case OverflowPolicy::DropOldest:
+            do
+            {
+                T dropped;
+                if (m_queue.try_pop(dropped))
+                {
+                    m_overflowCount++;
+                    done(dropped);
+                }
+            }
+            while (!m_queue.try_push(std::move(item)));
+            break;
+        case OverflowPolicy::Spill:
+            m_overflowCount++;
+            spill(item);
+            break;
+        }
+        schedule();
+    }
+
+    void start()
+    {
+        {
+            std::lock_guard<std::mutex> lk(m_mutex);
+            if (m_running == true) return;
+            m_running = true;
+        }
+
+        m_deadline.store(0, std::memory_order_relaxed);
+        m_overdue = false;
+        m_queue.open();
+        if (m_executor)
+        {
+            m_laneClosing.store(false, std::memory_order_relaxed);
+            m_scheduled.store(false, std::memory_order_relaxed);
+            m_laneFinished = false;
+            if (m_hooks.idle && m_hooks.idleInterval.count() != 0)
+                m_executor->addTimer(this, m_hooks.idleInterval);
+            return;
+        }
+
+        m_thread = std::thread([this]
+        {
+            if (m_hooks.started)
+                m_hooks.started();
+
+            //an idle thief looks at its peers every millisecond
+            std::chrono::milliseconds interval = m_hooks.steal ? std::chrono::milliseconds(1) : m_hooks.idleInterval;
+            if (m_hooks.idle && m_hooks.idleInterval.count() != 0)
+                interval = std::min(interval, m_hooks.idleInterval);
+            bool timed = interval.count() != 0;
+
+            std::deque<T> local_queue;
+            while (timed ? m_queue.pop_all_for(local_queue, interval) : m_queue.pop_all(local_queue))
+            {
+                bool worked = !local_queue.empty();
+                if (worked)
+                {
+                    TRACE_INSTANT("dequeue", local_queue.size());
+                    m_cpu.store(currentCpu(), std::memory_order_relaxed);
+                }
+                process(local_queue);
+                drainSpill(local_queue);
+                if (m_hooks.steal)
+                    worked = stealWork() || worked;
+
+                if (worked && m_hooks.batchDone)
+                    m_hooks.batchDone();
+                else if (!worked && m_hooks.idle)
+                    m_hooks.idle();
+            }
+            drainSpill(local_queue);
+            if (m_hooks.batchDone)
+                m_hooks.batchDone();
+        });
+        m_thread_id = m_thread.get_id();
+    }
+
+    //closes the queue and returns at once, stop() waits for the thread
+    //past a deadline the thread stops writing and keeps what is left for takeUndrained(), the default one never passes
+    void close(std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point())
+    {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        if (m_running == false || m_closing) return;
+        m_closing = true;
+        m_deadline.store(deadline.time_since_epoch().count(), std::memory_order_relaxed);
+        m_queue.close(); //worker drains what is left and exits
+        if (m_executor)
+        {
+            m_executor->removeTimer(this);
+            m_laneClosing.store(true, std::memory_order_seq_cst);
+            schedule(); //the last run sees the flag and finishes the lane
+        }
+    }
+
+    void stop()
+    {
+        close();
+        {
+            std::lock_guard<std::mutex> lk(m_mutex);
+            if (m_running == false) return;
+            m_running = false;
+            m_closing = false;
+        }
+
+        if (m_executor)
+        {
+            std::unique_lock<std::mutex> lk(m_mutex);
+            m_laneDone.wait(lk, [&] { return m_laneFinished; });
+            return;
+        }
+        m_thread.join();
+    }
+
+    //items a stop with a deadline did not write, oldest first; call it once the worker is stopped
+    std::vector<T> takeUndrained()
+    {
+        std::vector<T> undrained;
+        undrained.swap(m_undrained);
+        return undrained;
+    }
+
+    std::thread::id getThreadId ()
+    {
+        return m_thread_id;
+    }
+
+    //hands the oldest queued item to another worker
+    bool steal(T &item)
+    {
+        if (!m_queue.try_pop(item))
+            return false;
+        done(item);
+        return true;
+    }
+
+    std::size_t capacity() { return m_capacity; }
+    OverflowPolicy overflowPolicy() { return m_policy; }
+    std::size_t overflowCount() { return m_overflowCount.load(std::memory_order_relaxed); }
+    std::size_t pending() { return m_pending.load(std::memory_order_relaxed); }
+    std::size_t pendingBytes() { return m_pendingBytes.load(std::memory_order_relaxed); }
+    std::size_t stolenCount() { return m_stolenCount.load(std::memory_order_relaxed); }
+    int cpu() { return m_cpu.load(std::memory_order_relaxed); }
+    const WorkerStats &stats() const { return m_stats; }
+
+    //one lane run on an executor thread, never two at once for the same worker
+    void run()
+    {
+        if (m_thread_id == std::thread::id())
+            m_thread_id = std::this_thread::get_id(); //stats show the pool thread that ran the lane first
+
+        for (T item; m_batch.size() < LaneBatch && m_queue.try_pop(item);)
+            m_batch.push_back(std::move(item));
+        bool worked = !m_batch.empty();
+        if (worked)
+        {
+            TRACE_INSTANT("dequeue", m_batch.size());
+            m_cpu.store(currentCpu(), std::memory_order_relaxed);
+        }
+        process(m_batch);
+        drainSpill(m_batch);
+
+        if (worked && m_hooks.batchDone)
+            m_hooks.batchDone();
+        else if (!worked && m_hooks.idle)
+            m_hooks.idle();
+
+        //pairs with the fence in schedule, either the producer sees the lane idle or we see its item
+        m_scheduled.store(false, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bool pending = m_queue.size() != 0 || m_spill.pending() != 0;
+        if (!pending && !m_laneClosing.load(std::memory_order_seq_cst))
+            return;
+        if (m_scheduled.exchange(true, std::memory_order_acq_rel))
+            return; //someone posted the lane meanwhile, that run takes over
+        if (pending)
+        {
+            m_executor->post(this);
+            return;
+        }
+
+        //closed and drained, the lane stays marked as scheduled so nothing posts it again until start
+        if (!worked && m_hooks.batchDone)
+            m_hooks.batchDone();
+        std::lock_guard<std::mutex> lk(m_mutex);
+        m_laneFinished = true;
+        m_laneDone.notify_all();
+    }
+
+    //an executor timer, the lane runs once more to call its idle hook
+    bool tick()
+    {
+        return !m_scheduled.exchange(true, std::memory_order_acq_rel);
+    }
+
+private:
+    void schedule()
+    {
+        if (!m_executor)
+            return;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!m_scheduled.exchange(true, std::memory_order_acq_rel))
+            m_executor->post(this);
+    }
+
+    void process(std::deque<T> &local_queue)
+    {
+        for (auto& data : local_queue)
+        {
+            if (overdue())
+                m_undrained.push_back(data);
+            else
+                work(data);
+            done(data);
+        }
+        local_queue.clear();
+    }
+
+    //true once the stop deadline has passed, no clock is read until close() sets one
+    bool overdue()
+    {
+        if (m_overdue)
+            return true;
+        std::chrono::steady_clock::rep deadline = m_deadline.load(std::memory_order_relaxed);
+        m_overdue = deadline != 0 && std::chrono::steady_clock::now().time_since_epoch().count() >= deadline;
+        return m_overdue;
+    }
+
+    void work(const T &item)
+    {
+        {
+            TRACE_SCOPE("write", payloadCount(item));
+            m_workFunction(item);
+        }
+
+        std::chrono::steady_clock::time_point stamp = payloadStamp(item);
+        std::chrono::nanoseconds latency(-1);
+        if (stamp != std::chrono::steady_clock::time_point())
+            latency = std::chrono::steady_clock::now() - stamp;
+        m_stats.written(payloadCount(item), payloadBytes(item), latency);
+    }
+
+    void done(const T &item)
+    {
+        m_pendingBytes -= payloadBytes(item);
+        m_pending--;
+    }
+
+    bool stealWork()
+    {
+        bool stolen = false;
+        if (overdue())
+            return false; //past the deadline own items are only collected, there is no point taking more
+        for (T item; m_queue.size() == 0 && m_hooks.steal(item); m_stolenCount++, stolen = true)
+            work(item);
+        return stolen;
+    }
+
+    void spill(const T &item)
+    {
+        std::string record;
+        SpillTraits<T>::save(item, record);
+        if (!m_spill.push(record))
+            m_queue.push(T(item)); //no disk space left, fall back to waiting
+    }
+
+    //queued items are older than spilled ones, so the spill is read only when the queue is empty
+    void drainSpill(std::deque<T> &local_queue)
+    {
+        std::string record;
+        while (m_spill.pending() != 0)
+        {
+            for (T item; m_queue.try_pop(item);)
+                local_queue.push_back(std::move(item));
+
+            if (local_queue.empty())
+            {
+                std::size_t batch = std::max<std::size_t>(m_capacity, 1);
+                for (T item; local_queue.size() < batch && m_spill.pop(record);)
+                    if (SpillTraits<T>::load(record, item))
+                        local_queue.push_back(std::move(item));
+                if (local_queue.empty())
+                    break; //spill file is unreadable, nothing more to recover
+            }
+            process(local_queue);
+        }
+    }
+
+    std::function<void(const T&)> m_workFunction;
+    WorkerHooks<T> m_hooks;
+    Executor *m_executor;
+    Queue<T> m_queue;
+    SpillFile m_spill;
+    std::size_t m_capacity;
+    OverflowPolicy m_policy;
+    std::atomic<std::size_t> m_overflowCount{0};
+    std::atomic<std::size_t> m_pending{0};
+    std::atomic<std::size_t> m_pendingBytes{0};
+    std::atomic<std::size_t> m_stolenCount{0};
+    std::atomic<int> m_cpu{-1};
+    WorkerStats m_stats;
+    std::mutex m_mutex;
+    std::thread m_thread;
+    std::thread::id m_thread_id; //save thread id after thread stopped
+    bool m_running = false;
+    bool m_closing = false;
+    std::atomic<std::chrono::steady_clock::rep> m_deadline{0}; //steady clock ticks, 0 drains everything
+    bool m_overdue = false;       //worker thread only
+    std::vector<T> m_undrained;   //written by the worker thread until it exits
+
+    //lane state, used with an executor only
+    std::atomic<bool> m_scheduled{false}; //posted or running, the run that clears it passes the lane on
+    std::atomic<bool> m_laneClosing{false};
+    bool m_laneFinished = true;
+    std::condition_variable m_laneDone;
+    std::deque<T> m_batch;
+};
+
+template<typename T, template<typename> class Queue = MutexQueue>
+using WorkerHandle = std::unique_ptr<Worker<T, Queue> >;